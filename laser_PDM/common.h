@@ -2,6 +2,8 @@
 
 #include "hardware/clocks.h"
 #include "hardware/pio.h"
+#include "hardware/sync.h"
+#include "hardware/uart.h"
 #include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "pico/time.h"
@@ -35,10 +37,16 @@
 
 // Конфигурация
 #define LASER_PIN 2
-#define PDM_FREQ 3072000  // 3.072 MHz для 48kHz PCM
 #define CHANNELS 2
 #define BUFFER_SIZE 512
 
+// PDM oversampling ratio and per-bit dwell, selectable at runtime
+#define PDM_OSR_MIN       32
+#define PDM_OSR_MAX       128
+#define PDM_OSR_DEFAULT   64
+#define PDM_DWELL_MAX     31    // Delay field of "out pins, 1" (no side-set)
+#define PDM_DWELL_DEFAULT 7
+
 /* Blink pattern
  * - 25 ms   : streaming data
  * - 250 ms  : device not mounted
@@ -126,11 +134,24 @@ typedef struct {
 // extern core_shared_buffer_t shared_ppm_data;
 // extern volatile bool        sem_initialized;
 
+// PDM output configuration. Everything below osr/bit_dwell is derived by
+// pdm_config_derive() so the PIO divider, interpolator and DMA block size
+// always agree with each other and with the current sample rate.
+typedef struct {
+    uint16_t osr;                 // PDM bits per PCM sample: 32, 64 or 128
+    uint8_t  bit_dwell;           // Extra PIO cycles each bit is held on the laser
+    uint8_t  interp_shift;        // log2(osr), step shift of the linear interpolator
+    uint16_t words_per_sample;    // osr / 32
+    uint16_t dma_block_words;     // PDM words per DMA transfer (one PCM buffer)
+    uint32_t bit_rate_hz;         // sample_rate * osr
+    float    pio_clkdiv;          // clk_sys / (bit_rate_hz * (1 + bit_dwell))
+} pdm_config_t;
+
 typedef struct {
     uint16_t pcm_buffer_a[BUFFER_SIZE];
     uint16_t pcm_buffer_b[BUFFER_SIZE];
-    uint32_t pdm_buffer_a[BUFFER_SIZE/32];
-    uint32_t pdm_buffer_b[BUFFER_SIZE/32];
+    uint32_t pdm_buffer_a[BUFFER_SIZE * PDM_OSR_MAX / 32];
+    uint32_t pdm_buffer_b[BUFFER_SIZE * PDM_OSR_MAX / 32];
     volatile bool pcm_buffer_switch;
     volatile bool pdm_buffer_switch;
     volatile bool pcm_ready;
@@ -144,6 +165,62 @@ typedef struct {
     int32_t prev_output;
 } delta_sigma_t;
 
-delta_sigma_t ds_modulator = {0};
+// Execution time and interrupt entry latency histograms, in SysTick cycles.
+// Every region is recorded on core 0. LATENCY_HIST=0 turns every probe into a no-op.
+#ifndef LATENCY_HIST
+#define LATENCY_HIST 0
+#endif
+
+#define LATENCY_BUCKETS 25    // Bucket b holds [2^(b-1), 2^b) cycles, SysTick is 24 bits
+
+typedef enum {
+    LAT_DMA_PDM,          // dma_pdm_handler body
+    LAT_DMA_PDM_ENTRY,    // DMA block done to handler entry, 1 us steps from a chained timer stamp
+    LAT_SPK_TASK,         // One spk_task() conversion
+    LAT_PDM_BLOCK,        // PCM -> PDM of one buffer in audio_processing_task()
+    LAT_N_REGIONS
+} latency_region_t;
+
+typedef struct {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} latency_hist_t;
+
+#if LATENCY_HIST
+#include "hardware/structs/systick.h"
+
+extern latency_hist_t latency_hists[LAT_N_REGIONS];
+
+static inline void latency_record(latency_region_t region, uint32_t cycles) {
+    latency_hist_t *hist   = &latency_hists[region];
+    uint32_t        bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+    hist->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    hist->count++;
+    if (cycles > hist->max) {
+        hist->max = cycles;
+    }
+}
+
+// SysTick counts down
+#define LATENCY_BEGIN(start)         uint32_t start = systick_hw->cvr
+#define LATENCY_END(region, start)   latency_record(region, (start - systick_hw->cvr) & 0xFFFFFF)
+#define LATENCY_RECORD(region, cyc)  latency_record(region, cyc)
+#else
+#define LATENCY_BEGIN(start)         ((void)0)
+#define LATENCY_END(region, start)   ((void)0)
+#define LATENCY_RECORD(region, cyc)  ((void)0)
+#endif
+
+// Deferred UART logger, drained by DMA from uart_log_task()
+void     uart_log_init(uart_inst_t *uart);
+void     uart_log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void     uart_log_task(void);
+uint32_t uart_log_dropped(void);
+
+void latency_init(void);    // Starts SysTick on the calling core
+void latency_reset(void);
+bool latency_format(latency_region_t region, char *line, size_t size);
 
 
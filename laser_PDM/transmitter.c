@@ -1,4 +1,5 @@
 #include "common.h"
+#include "hardware/dma.h"
 #include "hardware/uart.h"
 #include "pico/sem.h"
 #include "usb_descriptors.h"
@@ -26,11 +27,30 @@ static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
 int8_t  mute[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX + 1];      // +1 for master channel 0
 int16_t volume[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX + 1];    // +1 for master channel 0
 
+// Volume: dB -> linear gain lookup (Q15), one entry per dB of attenuation
+static const uint16_t db_to_gain_q15[] = {
+    32768, 29205, 26029, 23198, 20675, 18427, 16423, 14637,
+    13045, 11627, 10362, 9235, 8231, 7336, 6538, 5827,
+    5193, 4629, 4125, 3677, 3277, 2920, 2603, 2320,
+    2068, 1843, 1642, 1464, 1305, 1163, 1036, 924,
+    823, 734, 654, 583, 519, 463, 413, 368,
+    328, 292, 260, 232, 207, 184, 164, 146,
+    130, 116, 104, 92, 82, 73, 65, 58,
+    52, 46, 41, 37, 33, 29, 26, 23,
+    21};
+
+#define GAIN_UNITY_Q24    (1 << 24)
+#define GAIN_SMOOTH_SHIFT 7    // One-pole smoothing, ~128 samples, avoids zipper noise
+
+// Target and smoothed per-channel gains (Q24), applied in the conversion loop
+static volatile int32_t gain_target[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX];
+static int32_t          gain_current[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX];
+
 // Buffer for microphone data
 int32_t  mic_buf[CFG_TUD_AUDIO_FUNC_1_EP_IN_SW_BUF_SZ / 4];
 int16_t *mic_dst;
 // Buffer for speaker data
-// int32_t spk_buf[CFG_TUD_AUDIO_FUNC_1_EP_OUT_SW_BUF_SZ / 4];
+int32_t spk_buf[CFG_TUD_AUDIO_FUNC_1_EP_OUT_SW_BUF_SZ / 4];
 // Speaker data size received in the last frame
 uint16_t spk_data_size;
 // Resolution per format
@@ -49,6 +69,8 @@ void led_blinking_task(void);
 void spk_task(void);
 void mic_task(void);
 void audio_processing_task(void);
+void pdm_config_task(void);
+void uart_command_task(void);
 
 static PIO  pio = pio1;
 static uint sm_gen;
@@ -57,73 +79,202 @@ uint32_t audio_frame_ticks;
 
 static uint dma_chan_pdm;
 static uint pio_sm;
+static uint pdm_offset;
+
+#if LATENCY_HIST
+// Chained after every PDM block, copies TIMERAWL as the block ends, before
+// the IRQ is even taken. SysTick is private to the core and out of the DMA's
+// reach, so the stamp comes in 1 us steps.
+static uint              dma_chan_stamp;
+static volatile uint32_t pdm_block_done_us;
+static uint32_t          pdm_stamp_mhz;
+#endif
+
+static pio_program_t pdm_program;
+static uint16_t      pdm_instructions[laser_pdm_out_wrap + 1];
+
+static audio_buffers_t audio_buffers;
+static delta_sigma_t   ds_modulator;
+static uint16_t        pcm_fill_pos;
+
+// Active PDM configuration and the one requested over UART / by a rate change
+pdm_config_t         pdm_config;
+static volatile bool pdm_config_pending;
+static uint16_t      pdm_requested_osr   = PDM_OSR_DEFAULT;
+static uint8_t       pdm_requested_dwell = PDM_DWELL_DEFAULT;
+
+void __isr dma_pdm_handler(void);
+
+// Derive divider, interpolator and DMA sizes from osr/dwell and the sample rate
+static bool pdm_config_derive(pdm_config_t *cfg, uint16_t osr, uint8_t dwell, uint32_t sample_rate) {
+    if ((osr != 32 && osr != 64 && osr != 128) || dwell > PDM_DWELL_MAX) {
+        return false;
+    }
+
+    uint32_t bit_rate = sample_rate * osr;
+    float    div      = (float)clock_get_hz(clk_sys) / ((float)bit_rate * (1 + dwell));
+    if (div < 1.0f || div >= 65536.0f) {
+        return false;
+    }
+
+    cfg->osr              = osr;
+    cfg->bit_dwell        = dwell;
+    cfg->interp_shift     = (uint8_t)__builtin_ctz(osr);
+    cfg->words_per_sample = osr / 32;
+    cfg->dma_block_words  = BUFFER_SIZE * cfg->words_per_sample;
+    cfg->bit_rate_hz      = bit_rate;
+    cfg->pio_clkdiv       = div;
+    return true;
+}
+
+// Request a new osr/dwell; applied from the main loop by pdm_config_task()
+bool pdm_config_request(uint16_t osr, uint8_t dwell) {
+    pdm_config_t probe;
+    if (!pdm_config_derive(&probe, osr, dwell, current_sample_rate)) {
+        return false;
+    }
+    pdm_requested_osr   = osr;
+    pdm_requested_dwell = dwell;
+    pdm_config_pending  = true;
+    return true;
+}
+
+static void pdm_fill_silence(uint32_t *buffer, uint16_t words) {
+    // 50% density is the PDM zero level
+    for (uint16_t i = 0; i < words; i++) {
+        buffer[i] = 0xAAAAAAAA;
+    }
+}
 
 void setup_pdm_system() {
-    // Настройка PIO для PDM вывода
-    PIO pio = pio0;
-    pio_sm = 0;
-    uint offset = pio_add_program(pio, &pdm_out_program);
-    
-    pio_sm_config c = pdm_out_program_get_default_config(offset);
+    if (!pdm_config_derive(&pdm_config, pdm_requested_osr, pdm_requested_dwell, current_sample_rate)) {
+        // Fall back to defaults if the sample rate makes the request impossible
+        pdm_requested_osr   = PDM_OSR_DEFAULT;
+        pdm_requested_dwell = PDM_DWELL_DEFAULT;
+        pdm_config_derive(&pdm_config, PDM_OSR_DEFAULT, PDM_DWELL_DEFAULT, current_sample_rate);
+    }
+
+    // Patch per-bit dwell into the delay field of "out pins, 1"
+    memcpy(pdm_instructions, laser_pdm_out_program.instructions, sizeof(pdm_instructions));
+    pdm_instructions[laser_pdm_out_offset_bit] =
+        (uint16_t)((pdm_instructions[laser_pdm_out_offset_bit] & ~pio_encode_delay(PDM_DWELL_MAX)) |
+                   pio_encode_delay(pdm_config.bit_dwell));
+    pdm_program              = laser_pdm_out_program;
+    pdm_program.instructions = pdm_instructions;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+    pio_sm     = pio_claim_unused_sm(pio, true);
+    pdm_offset = pio_add_program(pio, &pdm_program);
+#pragma GCC diagnostic pop
+
+    pio_sm_config c = laser_pdm_out_program_get_default_config(pdm_offset);
     sm_config_set_out_pins(&c, LASER_PIN, 1);
-    sm_config_set_sideset_pins(&c, LASER_PIN);
-    
-    // Настройка частоты PDM
-    float div = (float)clock_get_hz(clk_sys) / PDM_FREQ;
-    sm_config_set_clkdiv(&c, div);
-    
-    sm_config_set_out_shift(&c, false, true, 32);
+    sm_config_set_clkdiv(&c, pdm_config.pio_clkdiv);
+
+    // LSB first, autopull every 32 bits so the bit stream has no gaps
+    sm_config_set_out_shift(&c, true, true, 32);
     sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
-    
-    // Инициализация GPIO
+
     pio_gpio_init(pio, LASER_PIN);
     pio_sm_set_consecutive_pindirs(pio, pio_sm, LASER_PIN, 1, true);
-    
-    // Запуск state machine
-    pio_sm_init(pio, pio_sm, offset, &c);
-    pio_sm_set_enabled(pio, pio_sm, true);
-    
-    // Настройка DMA для PDM
-    dma_chan_pdm = dma_claim_unused_channel(true);
+
+    pio_sm_init(pio, pio_sm, pdm_offset, &c);
+
+    pdm_fill_silence(audio_buffers.pdm_buffer_a, pdm_config.dma_block_words);
+    pdm_fill_silence(audio_buffers.pdm_buffer_b, pdm_config.dma_block_words);
+    audio_buffers.pdm_buffer_switch = false;
+    audio_buffers.pdm_ready         = false;
+
+    dma_chan_pdm             = (uint)dma_claim_unused_channel(true);
     dma_channel_config dma_c = dma_channel_get_default_config(dma_chan_pdm);
-    
+
     channel_config_set_transfer_data_size(&dma_c, DMA_SIZE_32);
     channel_config_set_read_increment(&dma_c, true);
     channel_config_set_write_increment(&dma_c, false);
     channel_config_set_dreq(&dma_c, pio_get_dreq(pio, pio_sm, true));
-    channel_config_set_chain_to(&dma_c, dma_chan_pdm);  // Зацикливание
-    
-    // Настройка прерывания DMA
+
+#if LATENCY_HIST
+    dma_chan_stamp           = (uint)dma_claim_unused_channel(true);
+    dma_channel_config stamp = dma_channel_get_default_config(dma_chan_stamp);
+    channel_config_set_transfer_data_size(&stamp, DMA_SIZE_32);
+    channel_config_set_read_increment(&stamp, false);
+    channel_config_set_write_increment(&stamp, false);
+    dma_channel_configure(dma_chan_stamp, &stamp, &pdm_block_done_us, &timer_hw->timerawl, 1, false);
+    channel_config_set_chain_to(&dma_c, dma_chan_stamp);
+    pdm_stamp_mhz = clock_get_hz(clk_sys) / 1000000;
+#endif
+
     dma_channel_set_irq0_enabled(dma_chan_pdm, true);
     irq_set_exclusive_handler(DMA_IRQ_0, dma_pdm_handler);
     irq_set_enabled(DMA_IRQ_0, true);
-    
-    // Запуск первого DMA transfer
+
     dma_channel_configure(
         dma_chan_pdm, &dma_c,
-        &pio0_hw->txf[pio_sm],
+        &pio->txf[pio_sm],
         audio_buffers.pdm_buffer_a,
-        BUFFER_SIZE/32,
-        true
-    );
+        pdm_config.dma_block_words,
+        true);
+
+    pio_sm_set_enabled(pio, pio_sm, true);
+
+    uart_log_printf("PDM: OSR %u, dwell %u, bit rate %lu Hz, clkdiv %.3f, DMA block %u words\r\n",
+           pdm_config.osr,
+           pdm_config.bit_dwell,
+           pdm_config.bit_rate_hz,
+           pdm_config.pio_clkdiv,
+           pdm_config.dma_block_words);
+}
+
+void stop_pdm_system() {
+    irq_set_enabled(DMA_IRQ_0, false);
+    dma_channel_set_irq0_enabled(dma_chan_pdm, false);
+    dma_channel_abort(dma_chan_pdm);
+    dma_channel_acknowledge_irq0(dma_chan_pdm);
+    dma_channel_unclaim(dma_chan_pdm);
+#if LATENCY_HIST
+    dma_channel_abort(dma_chan_stamp);
+    dma_channel_unclaim(dma_chan_stamp);
+#endif
+
+    pio_sm_set_enabled(pio, pio_sm, false);
+    pio_sm_clear_fifos(pio, pio_sm);
+    pio_remove_program(pio, &pdm_program, pdm_offset);
+    pio_sm_unclaim(pio, pio_sm);
+}
+
+// Rebuild the PDM chain when osr/dwell or the sample rate changed
+void pdm_config_task(void) {
+    if (!pdm_config_pending) {
+        return;
+    }
+    pdm_config_pending = false;
+
+    stop_pdm_system();
+    ds_modulator = (delta_sigma_t){0};
+    setup_pdm_system();
 }
 
 // Обработчик DMA прерывания
 void __isr dma_pdm_handler() {
+    LATENCY_BEGIN(isr_start);
+
     if (dma_channel_get_irq0_status(dma_chan_pdm)) {
         dma_channel_acknowledge_irq0(dma_chan_pdm);
-        
+
+        LATENCY_RECORD(LAT_DMA_PDM_ENTRY, (timer_hw->timerawl - pdm_block_done_us) * pdm_stamp_mhz);
+
         // Переключение буферов
         audio_buffers.pdm_buffer_switch = !audio_buffers.pdm_buffer_switch;
-        uint32_t *next_buffer = audio_buffers.pdm_buffer_switch ? 
-                               audio_buffers.pdm_buffer_b : 
-                               audio_buffers.pdm_buffer_a;
-        
+        uint32_t *next_buffer = audio_buffers.pdm_buffer_switch ? audio_buffers.pdm_buffer_b : audio_buffers.pdm_buffer_a;
+
         // Настройка следующего transfer
         dma_channel_set_read_addr(dma_chan_pdm, next_buffer, true);
-        
+
         // Сигнал для обработки в основном цикле
         audio_buffers.pdm_ready = true;
+
+        LATENCY_END(LAT_DMA_PDM, isr_start);
     }
 }
 
@@ -132,6 +283,7 @@ void setup_uart() {
     gpio_set_function(UART_TX_PIN, GPIO_FUNC_UART);
     gpio_set_function(UART_RX_PIN, GPIO_FUNC_UART);
     stdio_uart_init();
+    uart_log_init(UART_ID);
 }
 
 // void init_double_buffering(void) {
@@ -148,40 +300,78 @@ void generate_pulse(uint32_t pause_width) {
     pio_sm_put_blocking(pio, sm_gen, pause_width);
 }
 
-uint32_t calculate_audio_frame_ticks() {
-    return 1000000 / current_sample_rate;
+// UAC2 volume (1/256 dB) to Q24 gain, linear interpolation between table entries
+static int32_t volume_to_gain_q24(int32_t vol) {
+    if (vol >= 0) {
+        return GAIN_UNITY_Q24;
+    }
+
+    uint32_t att = (uint32_t)-vol;
+    uint32_t idx = att >> 8;
+    if (idx >= TU_ARRAY_SIZE(db_to_gain_q15) - 1) {
+        return 0;
+    }
+
+    int32_t frac = (int32_t)(att & 0xFF);
+    int32_t g    = db_to_gain_q15[idx] - (((db_to_gain_q15[idx] - db_to_gain_q15[idx + 1]) * frac) >> 8);
+    return g << 9;
 }
 
-uint32_t pcm_to_pdm_advanced(uint16_t *pcm_samples, int count) {
-    uint32_t pdm_word = 0;
-    
-    for (int i = 0; i < count && i < 32; i++) {
-        // Преобразование в знаковый формат
-        int32_t pcm_signed = (int32_t)pcm_samples[i] - 32768;
-        
-        // Дельта-сигма модулятор второго порядка
-        int32_t error1 = pcm_signed - ds_modulator.prev_output;
-        ds_modulator.integrator1 += error1;
-        
-        int32_t error2 = ds_modulator.integrator1 - ds_modulator.prev_output;
-        ds_modulator.integrator2 += error2;
-        
-        // Квантование
-        int32_t output;
-        if (ds_modulator.integrator2 >= 0) {
-            output = 32767;
-            pdm_word |= (1 << i);
-        } else {
-            output = -32768;
+// Recompute channel gains after a mute/volume change, master channel 0 applies to all
+static void update_channel_gains(void) {
+    for (uint8_t ch = 0; ch < CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX; ch++) {
+        if (mute[0] || mute[ch + 1]) {
+            gain_target[ch] = 0;
+        }
+        else {
+            gain_target[ch] = volume_to_gain_q24(volume[0] + volume[ch + 1]);
         }
-        
-        ds_modulator.prev_output = output;
     }
-    
-    return pdm_word;
 }
 
+static inline int32_t apply_gain(int32_t sample, int32_t *gain, int32_t target) {
+    *gain += (target - *gain) >> GAIN_SMOOTH_SHIFT;
+    return (sample * (*gain >> 9)) >> 15;
+}
 
+uint32_t calculate_audio_frame_ticks() {
+    return 1000000 / current_sample_rate;
+}
+
+// Second order delta-sigma modulator, one PCM sample -> osr PDM bits.
+// Linear interpolation from the previous sample replaces the zero-order hold.
+void pcm_to_pdm_advanced(int32_t prev, int32_t next, uint32_t *pdm_words) {
+    int32_t  step  = (next - prev) >> pdm_config.interp_shift;
+    int32_t  value = prev;
+    uint32_t pdm_word;
+
+    for (uint16_t w = 0; w < pdm_config.words_per_sample; w++) {
+        pdm_word = 0;
+        for (int i = 0; i < 32; i++) {
+            value += step;
+
+            // Дельта-сигма модулятор второго порядка
+            int32_t error1 = value - ds_modulator.prev_output;
+            ds_modulator.integrator1 += error1;
+
+            int32_t error2 = ds_modulator.integrator1 - ds_modulator.prev_output;
+            ds_modulator.integrator2 += error2;
+
+            // Квантование
+            int32_t output;
+            if (ds_modulator.integrator2 >= 0) {
+                output = 32767;
+                pdm_word |= (1u << i);
+            }
+            else {
+                output = -32768;
+            }
+
+            ds_modulator.prev_output = output;
+        }
+        pdm_words[w] = pdm_word;
+    }
+}
 
 // Initialize PIO for pulse generator
 // void init_pulse_generator(float freq) {
@@ -243,6 +433,7 @@ uint32_t pcm_to_pdm_advanced(uint16_t *pcm_samples, int count) {
 
 void first_core_main() {
     board_init();
+    latency_init();
     setup_uart();
 
     tusb_rhport_init_t dev_init = {
@@ -257,24 +448,23 @@ void first_core_main() {
     TU_LOG1("Laser Audio running\r\n");
     stdio_init_all();
 
-    init_double_buffering();
-
-    init_pulse_generator(PIO_FREQ);
+    update_channel_gains();
+    for (uint8_t ch = 0; ch < CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX; ch++) {
+        gain_current[ch] = gain_target[ch];
+    }
 
     audio_frame_ticks = 1000000 / AUDIO_SAMPLE_RATE;
 
-    // Setup timer interrupt for audio sampling
-    //irq_set_exclusive_handler(TIMER_IRQ_0, timer0_irq_handler);
-    hw_set_bits(&timer_hw->inte, (1u << 0));
-    irq_set_enabled(TIMER_IRQ_0, true);
-
-    timer_hw->alarm[0] = timer_hw->timerawl + audio_frame_ticks;
+    setup_pdm_system();
 
     // Main operation loop on Core1
     while (1) {
         tud_task();
         spk_task();
         audio_processing_task();
+        pdm_config_task();
+        uart_command_task();
+        uart_log_task();
         mic_task();
         led_blinking_task();
     }
@@ -359,6 +549,11 @@ static bool tud_audio_clock_set_request(uint8_t rhport, audio_control_request_t
         current_sample_rate = (uint32_t)((audio_control_cur_4_t const *)buf)->bCur;
         audio_frame_ticks   = calculate_audio_frame_ticks();
 
+        // PIO divider depends on the sample rate
+        if (!pdm_config_request(pdm_config.osr, pdm_config.bit_dwell)) {
+            pdm_config_request(PDM_OSR_DEFAULT, PDM_DWELL_DEFAULT);
+        }
+
         TU_LOG1("Clock set current freq: %" PRIu32 "\r\n", current_sample_rate);
 
         return true;
@@ -414,6 +609,7 @@ static bool tud_audio_feature_unit_set_request(uint8_t rhport, audio_control_req
         TU_VERIFY(request->wLength == sizeof(audio_control_cur_1_t));
 
         mute[request->bChannelNumber] = ((audio_control_cur_1_t const *)buf)->bCur;
+        update_channel_gains();
 
         TU_LOG1("Set channel %d Mute: %d\r\n", request->bChannelNumber, mute[request->bChannelNumber]);
 
@@ -423,6 +619,7 @@ static bool tud_audio_feature_unit_set_request(uint8_t rhport, audio_control_req
         TU_VERIFY(request->wLength == sizeof(audio_control_cur_2_t));
 
         volume[request->bChannelNumber] = ((audio_control_cur_2_t const *)buf)->bCur;
+        update_channel_gains();
 
         TU_LOG1("Set channel %d volume: %d dB\r\n", request->bChannelNumber, volume[request->bChannelNumber] / 256);
 
@@ -510,12 +707,9 @@ bool tud_audio_rx_done_pre_read_cb(uint8_t rhport, uint16_t n_bytes_received, ui
     (void)ep_out;
     (void)cur_alt_setting;
 
-    if (!spk_buffers[current_spk_write_buffer].ready) {
+    if (spk_data_size == 0) {
         spk_data_size = tud_audio_read(spk_buf, n_bytes_received);
         TU_LOG1("RX done pre read callback called, received %d bytes\r\n", spk_data_size);
-        if (sem_initialized) {
-            shared_ppm_data.packet_size = spk_data_size;
-        }
         return true;
     }
     TU_LOG1("RX done pre read callback called, but buffer is not ready\r\n");
@@ -532,27 +726,38 @@ bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, u
 }
 
 void spk_task(void) {
-    if (spk_data_size && !spk_buffers[current_spk_write_buffer].ready) {
+    if (spk_data_size) {
+        LATENCY_BEGIN(task_start);
+
         if (current_resolution == 16) {
-            int16_t  *src        = (int16_t *)spk_buf;
-            int16_t  *limit      = (int16_t *)spk_buf + spk_data_size / 2;
-            uint16_t *dst        = spk_buffers[current_spk_write_buffer].ppm_buffer;
-            uint16_t  buffer_pos = 0;
+            int16_t  *src          = (int16_t *)spk_buf;
+            int16_t  *limit        = (int16_t *)spk_buf + spk_data_size / 2;
+            uint16_t *dst          = audio_buffers.pcm_buffer_switch ? audio_buffers.pcm_buffer_b : audio_buffers.pcm_buffer_a;
+            int32_t   target_left  = gain_target[0];
+            int32_t   target_right = gain_target[1];
 
+            // Gain is applied in the same pass that feeds the modulator
             while (src < limit) {
-                int32_t left      = *src++;
-                int32_t right     = *src++;
-                int16_t mixed     = (int16_t)((left >> 1) + (right >> 1));
-                dst[buffer_pos++] = audio_to_ppm(mixed);
+                int32_t left  = apply_gain(*src++, &gain_current[0], target_left);
+                int32_t right = apply_gain(*src++, &gain_current[1], target_right);
+                int16_t mixed = (int16_t)((left >> 1) + (right >> 1));
+
+                dst[pcm_fill_pos++] = (uint16_t)(mixed + 32768);
+
+                if (pcm_fill_pos >= BUFFER_SIZE) {
+                    pcm_fill_pos = 0;
+                    // Drop the block if the modulator has not taken the previous one
+                    if (!audio_buffers.pcm_ready) {
+                        audio_buffers.pcm_buffer_switch = !audio_buffers.pcm_buffer_switch;
+                        audio_buffers.pcm_ready         = true;
+                        dst = audio_buffers.pcm_buffer_switch ? audio_buffers.pcm_buffer_b : audio_buffers.pcm_buffer_a;
+                    }
+                }
             }
-
-            spk_buffers[current_spk_write_buffer].size     = buffer_pos;
-            spk_buffers[current_spk_write_buffer].position = 0;
-            spk_buffers[current_spk_write_buffer].ready    = true;
-
-            current_spk_write_buffer = (uint8_t)((current_spk_write_buffer + 1) % 2);
         }
         spk_data_size = 0;
+
+        LATENCY_END(LAT_SPK_TASK, task_start);
     }
 }
 
@@ -591,32 +796,102 @@ void mic_task(void) {
 
 void audio_processing_task() {
     static uint32_t sample_counter = 0;
-    
+    static int32_t  last_sample    = 0;
+
     // Обработка PCM -> PDM когда готовы новые данные
-    if (audio_buffers.pcm_ready) {
-        uint16_t *pcm_source = audio_buffers.pcm_buffer_switch ? 
-                              audio_buffers.pcm_buffer_a : 
-                              audio_buffers.pcm_buffer_b;
-        
-        uint32_t *pdm_dest = audio_buffers.pdm_buffer_switch ? 
-                            audio_buffers.pdm_buffer_a : 
-                            audio_buffers.pdm_buffer_b;
-        
-        // Преобразование PCM в PDM
-        for (int i = 0; i < BUFFER_SIZE/32; i++) {
-            pdm_dest[i] = pcm_to_pdm_advanced(&pcm_source[i * 32], 32);
+    if (audio_buffers.pcm_ready && audio_buffers.pdm_ready) {
+        uint16_t *pcm_source = audio_buffers.pcm_buffer_switch ? audio_buffers.pcm_buffer_a : audio_buffers.pcm_buffer_b;
+
+        uint32_t *pdm_dest = audio_buffers.pdm_buffer_switch ? audio_buffers.pdm_buffer_a : audio_buffers.pdm_buffer_b;
+
+        LATENCY_BEGIN(block_start);
+
+        // Преобразование PCM в PDM, words_per_sample слов на каждый отсчёт
+        for (int i = 0; i < BUFFER_SIZE; i++) {
+            int32_t sample = (int32_t)pcm_source[i] - 32768;
+            pcm_to_pdm_advanced(last_sample, sample, &pdm_dest[i * pdm_config.words_per_sample]);
+            last_sample = sample;
         }
-        
-        // Переключение буферов
-        audio_buffers.pcm_buffer_switch = !audio_buffers.pcm_buffer_switch;
+
+        LATENCY_END(LAT_PDM_BLOCK, block_start);
+
         audio_buffers.pcm_ready = false;
-        
+        audio_buffers.pdm_ready = false;
+
         sample_counter++;
+
+        // Мониторинг производительности, один раз на 1000 буферов
+        if (sample_counter % 1000 == 0) {
+            uart_log_printf("Processed %lu buffers, log dropped %lu\r\n", sample_counter, uart_log_dropped());
+        }
+    }
+}
+
+// Simple line commands on UART0: "osr <32|64|128>", "dwell <0..31>", "pdm", "lat [reset]"
+static void process_command(char *input) {
+    char *arg   = strchr(input, ' ');
+    long  value = -1;
+
+    if (arg) {
+        *arg++ = '\0';
+        char *endptr;
+        value = strtol(arg, &endptr, 10);
+        if (endptr == arg) {
+            value = -1;
+        }
+    }
+
+    if (strcmp(input, "osr") == 0 && value >= 0 && value <= PDM_OSR_MAX) {
+        if (!pdm_config_request((uint16_t)value, pdm_config.bit_dwell)) {
+            uart_log_printf("OSR must be 32, 64 or 128 and fit the PIO clock\r\n");
+        }
+    }
+    else if (strcmp(input, "dwell") == 0 && value >= 0) {
+        if (value > PDM_DWELL_MAX || !pdm_config_request(pdm_config.osr, (uint8_t)value)) {
+            uart_log_printf("Dwell must be 0..%d and fit the PIO clock\r\n", PDM_DWELL_MAX);
+        }
+    }
+    else if (strcmp(input, "pdm") == 0) {
+        uart_log_printf("PDM: OSR %u, dwell %u, bit rate %lu Hz, clkdiv %.3f, DMA block %u words\r\n",
+               pdm_config.osr,
+               pdm_config.bit_dwell,
+               pdm_config.bit_rate_hz,
+               pdm_config.pio_clkdiv,
+               pdm_config.dma_block_words);
     }
-    
-    // Мониторинг производительности
-    if (sample_counter % 1000 == 0) {
-        printf("Processed %lu buffers\n", sample_counter);
+    else if (strcmp(input, "lat") == 0) {
+        // "lat" dumps, "lat reset" clears
+        if (arg && strcmp(arg, "reset") == 0) {
+            latency_reset();
+        }
+        else {
+            char line[96];
+            for (uint32_t region = 0; latency_format((latency_region_t)region, line, sizeof(line)); region++) {
+                uart_log_printf("%s", line);
+            }
+        }
+    }
+    else {
+        uart_log_printf("Commands: osr <32|64|128>, dwell <0..%d>, pdm, lat [reset]\r\n", PDM_DWELL_MAX);
+    }
+}
+
+void uart_command_task(void) {
+    static char   input[32];
+    static size_t input_pos = 0;
+
+    while (uart_is_readable(UART_ID)) {
+        char c = uart_getc(UART_ID);
+        if (c == '\r' || c == '\n') {
+            if (input_pos > 0) {
+                input[input_pos] = '\0';
+                process_command(input);
+                input_pos = 0;
+            }
+        }
+        else if (input_pos < sizeof(input) - 1) {
+            input[input_pos++] = c;
+        }
     }
 }
 
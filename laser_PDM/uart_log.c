@@ -0,0 +1,96 @@
+#include "common.h"
+#include "hardware/dma.h"
+#include "hardware/uart.h"
+#include <stdarg.h>
+#include <string.h>
+
+// Deferred logger: messages are formatted into a byte ring on the main loop
+// and drained to the UART TX FIFO by DMA, so a log line never waits for the
+// wire. A message that does not fit is dropped whole and counted.
+// Main loop only, not for use from interrupt handlers.
+#define UART_LOG_RING_SIZE 2048    // Power of 2
+#define UART_LOG_LINE_MAX  128
+
+static char         log_ring[UART_LOG_RING_SIZE];
+static uint32_t     log_head      = 0;    // Free running, next byte to write
+static uint32_t     log_tail      = 0;    // Free running, first byte not yet sent
+static uint32_t     log_in_flight = 0;    // Bytes the DMA is sending from log_tail
+static uint32_t     log_dropped   = 0;
+static uint32_t     log_reported  = 0;    // log_dropped already announced on the wire
+static int          log_dma_chan  = -1;
+static uart_inst_t *log_uart;
+
+void uart_log_init(uart_inst_t *uart) {
+    log_uart     = uart;
+    log_dma_chan = dma_claim_unused_channel(true);
+}
+
+static bool uart_log_put(const char *text, uint32_t len) {
+    if (UART_LOG_RING_SIZE - (log_head - log_tail) < len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        log_ring[(log_head + i) & (UART_LOG_RING_SIZE - 1)] = text[i];
+    }
+    log_head += len;
+    return true;
+}
+
+void uart_log_printf(const char *format, ...) {
+    char    line[UART_LOG_LINE_MAX];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len <= 0) {
+        return;
+    }
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    if (!uart_log_put(line, (uint32_t)len)) {
+        log_dropped++;
+    }
+}
+
+uint32_t uart_log_dropped(void) {
+    return log_dropped;
+}
+
+// Retire the finished transfer and start the next contiguous segment
+void uart_log_task(void) {
+    if (log_dma_chan < 0 || dma_channel_is_busy((uint)log_dma_chan)) {
+        return;
+    }
+    log_tail      += log_in_flight;
+    log_in_flight  = 0;
+
+    if (log_reported != log_dropped) {
+        char note[48];
+        int  len = snprintf(note, sizeof(note), "[log: %lu messages dropped]\r\n", log_dropped - log_reported);
+        if (uart_log_put(note, (uint32_t)len)) {
+            log_reported = log_dropped;
+        }
+    }
+
+    if (log_head == log_tail) {
+        return;
+    }
+
+    uint32_t start = log_tail & (UART_LOG_RING_SIZE - 1);
+    uint32_t len   = log_head - log_tail;
+    if (len > UART_LOG_RING_SIZE - start) {
+        len = UART_LOG_RING_SIZE - start;
+    }
+
+    dma_channel_config c = dma_channel_get_default_config((uint)log_dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, uart_get_dreq(log_uart, true));
+
+    log_in_flight = len;
+    dma_channel_configure((uint)log_dma_chan, &c, &uart_get_hw(log_uart)->dr, &log_ring[start], len, true);
+}
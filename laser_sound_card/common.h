@@ -2,6 +2,7 @@
 
 #include "hardware/clocks.h"
 #include "hardware/pio.h"
+#include "hardware/sync.h"
 #include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "pico/time.h"
@@ -16,10 +17,52 @@
 // Include generated header files with PIO programs
 #include "ppm.pio.h"
 
+// Detector program, selected at build time
+#define DETECTOR_PAUSE     0    // pulse_detector: pause length
+#define DETECTOR_PACKED    1    // pulse_detector_packed: high time << 16 | pause length
+#define DETECTOR_QUALIFIED 2    // pulse_detector_qualified: pause length, 0 or ~loops left for a rejected glitch
+#define DETECTOR_DUAL      3    // pulse_detector on two SMs half a count apart, pulse_generator_fine
+#ifndef DETECTOR_MODE
+#define DETECTOR_MODE DETECTOR_PAUSE
+#endif
+
+// Signal loss. pulse_detector (DETECTOR_PAUSE, DETECTOR_DUAL) gives up after
+// DETECTOR_TIMEOUT_US without a pulse and pushes DETECTOR_LOST
+#define DETECTOR_TIMEOUT_US     1000
+#define DETECTOR_TIMEOUT_COUNTS (DETECTOR_TIMEOUT_US * (SYS_FREQ / 1000) / 2)    // 2 cycles per count
+#define DETECTOR_LOST           0xFFFFFFFFu
+
+// Shortest high time accepted as a pulse by DETECTOR_QUALIFIED, PIO cycles.
+// Can be changed at run time with the "glitch" CDC command
+#ifndef DETECTOR_MIN_HIGH_CYCLES
+#define DETECTOR_MIN_HIGH_CYCLES 5
+#endif
+
 #define PULSE_GEN_PIN 0
 #define PULSE_DET_PIN 1
 #define LED_PIN       25
 
+// Lanes.
+// PPM_LANES generator/detector pairs on their own pins share the sample
+// stream: sample i of every frame of PPM_LANES samples goes out on lane i, so
+// each lane runs at 1/PPM_LANES of the sample rate and has that much longer
+// for a symbol. The generators are pio1 SMs 0..PPM_LANES-1, loaded together
+// by one DMA transfer per frame. Pilots go out on all lanes in the same frame
+// and the receiver realigns the lanes on them; while audio streams without
+// gaps that needs "pilot audio". The pulse timestamps need an
+// SM of their own on pio0 and only run with one lane.
+#ifndef PPM_LANES
+#define PPM_LANES 1
+#endif
+#if PPM_LANES < 1 || PPM_LANES > 4
+#error "PPM_LANES must be 1 to 4"
+#endif
+#if PPM_LANES > 1 && DETECTOR_MODE != DETECTOR_PAUSE
+#error "Multiple lanes need DETECTOR_MODE=DETECTOR_PAUSE"
+#endif
+#define LANE_GEN_PINS {PULSE_GEN_PIN, 2, 4, 6}
+#define LANE_DET_PINS {PULSE_DET_PIN, 3, 5, 7}
+
 // #define SYS_FREQ 133000
 #define SYS_FREQ 250000
 
@@ -29,7 +72,14 @@
 #define MIN_TACKT 8
 #endif
 
-#define MAX_CODE          1024
+// Dual phase widths are in single cycles
+#if DETECTOR_MODE == DETECTOR_DUAL
+#define DETECTOR_TACKT (2 * MIN_TACKT)
+#else
+#define DETECTOR_TACKT MIN_TACKT
+#endif
+
+#define MAX_CODE          (1 << PPM_CODE_BITS_MAX)
 #define MIN_PULSE_PERIOD  3.0f
 #define AUDIO_SAMPLE_RATE 48000
 
@@ -66,8 +116,77 @@ enum
 static const float MIN_PULSE_PERIOD_US = MIN_PULSE_PERIOD / 2;
 static const float PIO_FREQ            = SYS_FREQ * 1000.0f;
 
+// PPM symbol budget.
+// pulse_generator spends 2 cycles per pause count (nop + jmp) plus 8 cycles
+// for pull/mov and the two pulses, so a frame with code c takes
+// 2 * (MIN_INTERVAL_CYCLES + c) + 8 PIO cycles. It has to fit into one sample
+// period (PPM_LANES of them with lanes) minus one timer tick of pacing
+// jitter; if the full code width does not fit, the code is narrowed until it
+// does.
+// With DETECTOR_DUAL, pulse_generator_fine spends 1 cycle per count and 7
+// cycles on the rest. The minimum pause keeps its length in time, and the
+// frame that held 10 bit codes holds 11 bit ones.
+#define PPM_CODE_BITS_MIN 6
+#if DETECTOR_MODE == DETECTOR_DUAL
+#define PPM_CODE_BITS_MAX        11    // 1 << PPM_CODE_BITS_MAX == MAX_CODE
+#define PPM_GEN_CYCLES_PER_COUNT 1
+#define PPM_GEN_OVERHEAD_CYCLES  7
+#else
+#define PPM_CODE_BITS_MAX        10
+#define PPM_GEN_CYCLES_PER_COUNT 2
+#define PPM_GEN_OVERHEAD_CYCLES  8
+#endif
+
 static const uint16_t MIN_INTERVAL_CYCLES =
-    MIN_PULSE_PERIOD_US * (SYS_FREQ / 1000);
+    MIN_PULSE_PERIOD_US * (SYS_FREQ / 1000) * 2 / PPM_GEN_CYCLES_PER_COUNT;
+
+static inline uint32_t ppm_frame_cycles(uint32_t sys_khz, uint8_t code_bits) {
+    uint32_t min_interval = (uint32_t)(MIN_PULSE_PERIOD_US * (sys_khz / 1000) * 2 / PPM_GEN_CYCLES_PER_COUNT);
+    return PPM_GEN_CYCLES_PER_COUNT * (min_interval + (1u << code_bits)) + PPM_GEN_OVERHEAD_CYCLES;
+}
+
+// Widest code that fits one lane symbol period, 0 if the rate is not feasible
+static inline uint8_t ppm_code_bits_for(uint32_t sys_khz, uint32_t sample_rate) {
+    uint32_t budget = sys_khz * 1000 * PPM_LANES / sample_rate - sys_khz / 1000;
+    for (uint8_t bits = PPM_CODE_BITS_MAX; bits >= PPM_CODE_BITS_MIN; bits--) {
+        if (ppm_frame_cycles(sys_khz, bits) <= budget) {
+            return bits;
+        }
+    }
+    return 0;
+}
+
+// Control band.
+// The top 1/16 of every code width carries no audio, it holds known symbols
+// the receiver can measure the link with. Audio is scaled into the codes
+// below the band. Symbols sit a quarter band apart with a tolerance of an
+// eighth, so the detector error that still decodes audio cannot mistake one
+// for another.
+#define PPM_CONTROL_SHIFT  4      // Band is (1 << bits) >> PPM_CONTROL_SHIFT codes
+#define PPM_PILOT_INTERVAL       256                         // A pilot is due every this many frames
+#define PPM_PILOT_AUDIO_INTERVAL (16 * PPM_PILOT_INTERVAL)    // Longest a due pilot waits for a frame without audio
+
+static inline uint32_t ppm_control_band(uint8_t code_bits) {
+    return (1u << code_bits) >> PPM_CONTROL_SHIFT;
+}
+
+static inline uint32_t ppm_audio_span(uint8_t code_bits) {
+    return (1u << code_bits) - ppm_control_band(code_bits);
+}
+
+static inline uint32_t ppm_pilot_code(uint8_t code_bits) {
+    return (1u << code_bits) - ppm_control_band(code_bits) * 3 / 4;
+}
+
+// Marks one sample for end to end latency measurement
+static inline uint32_t ppm_marker_code(uint8_t code_bits) {
+    return (1u << code_bits) - ppm_control_band(code_bits) / 4;
+}
+
+static inline bool ppm_is_symbol(uint32_t width, uint32_t code, uint8_t code_bits) {
+    uint32_t tol = ppm_control_band(code_bits) / 8;
+    return width + tol >= code && width <= code + tol;
+}
 
 // Main function signatures
 void first_core_main(void);     // Function for Core0 (receiver)
@@ -75,27 +194,183 @@ void second_core_main(void);    // Function for Core1 (transmitter + interface)
 
 // Statistics structure
 typedef struct {
-    uint32_t total_pcm_received;
-    uint32_t total_ppm_convert;
-    uint32_t total_pcm_convert;
-    uint32_t total_ppm_sent;
-    uint32_t total_ppm_received;
-    uint32_t total_sent;
-    uint32_t total_received;
-    uint64_t total_summed_ppm_out;    // Sum of all PPM values at output
-    uint64_t total_summed_ppm_in;     // Sum of all PPM values at input
-    uint64_t total_summed_ppm_in_usb; // Sum of all PPM values after reception, before USB transmission
-    uint64_t total_ticks_attempt_send_to_usb;
-    uint64_t total_bytes_sent_to_usb;
+    volatile uint32_t seq;                                // Odd while the owning core is updating
+    uint32_t          total_pcm_received;                 // Stereo frames received from USB
+    uint32_t          total_ppm_convert;                  // Codes produced for the transmitter
+    uint32_t          total_pcm_convert;                  // Samples converted for the USB microphone
+    uint32_t          total_ppm_sent;                     // Codes sent by the transmit timer
+    uint32_t          total_ppm_received;                 // Valid widths from the detector
+    uint32_t          total_sent;                         // Transmit timer ticks, idle included
+    uint32_t          total_received;                     // Detector results, invalid included
+    uint32_t          total_fifo_pushed;                  // Samples passed to core 0
+    uint32_t          total_fifo_dropped;                 // Samples lost because the inter-core FIFO was full
+    uint64_t          total_summed_ppm_out;               // Sum of all PPM values at output
+    uint64_t          total_summed_ppm_in;                // Sum of all PPM values at input
+    uint64_t          total_summed_ppm_in_usb;            // Sum of all PPM values after reception, before USB transmission
+    uint64_t          total_ticks_attempt_send_to_usb;    // IN packets written
+    uint64_t          total_bytes_sent_to_usb;
 } statistics_t;
 
-// Structure for speaker double buffering
 typedef struct {
-    uint16_t          ppm_buffer[(CFG_TUD_AUDIO_FUNC_1_EP_OUT_SW_BUF_SZ / 4) / 2];    // Buffer for ready PPM values
-    volatile uint16_t size;                                                           // Number of PPM values in buffer
-    volatile uint16_t position;                                                       // Current position for reading
-    volatile bool     ready;                                                          // Buffer ready for use
-} spk_ppm_buffer_t;
+    statistics_t total;         // Both cores merged
+    statistics_t per_second;    // Change since the previous snapshot, per second
+    uint32_t     interval_ms;
+} statistics_snapshot_t;
+
+extern statistics_t core0_stats;    // USB callbacks, transmit ISR, mic packetizer
+extern statistics_t core1_stats;    // Detector and inter-core queue
+
+// Core 1 brackets the publish of each batch so core 0 can take a consistent copy
+static inline void statistics_begin(statistics_t *stats) {
+    stats->seq++;
+    __dmb();
+}
+
+static inline void statistics_end(statistics_t *stats) {
+    __dmb();
+    stats->seq++;
+}
+
+void statistics_snapshot(statistics_snapshot_t *snap);
+
+// Event trace, one ring per core. TRACE_STAGES is a bitmask of traced stages,
+// with 0 every trace point compiles to nothing.
+#ifndef TRACE_STAGES
+#define TRACE_STAGES 0
+#endif
+
+#define TRACE_RING_SIZE 512           // Events per core, power of two
+#define TRACE_MAGIC     0x45435254    // "TRCE" at the start of every dump frame
+
+typedef enum {
+    TRACE_TX_ISR,       // timer0_irq_handler, value - sent code
+    TRACE_SOF,          // tud_sof_cb, value - frame number
+    TRACE_SPK_RX,       // Speaker packet, value - codes queued
+    TRACE_MIC_FRAME,    // Mic packet, value - samples
+    TRACE_MIC_TASK,     // FIFO drain on core 0, value - samples
+    TRACE_RX_DRAIN,     // update_measurements, value - widths read
+    TRACE_PLC,          // Concealed sample, value - code
+    TRACE_N_STAGES
+} trace_stage_t;
+
+typedef enum {
+    TRACE_PHASE_INSTANT,
+    TRACE_PHASE_BEGIN,
+    TRACE_PHASE_END,
+} trace_phase_t;
+
+typedef struct {
+    uint32_t timestamp;    // time_us_32(), shared by both cores
+    uint8_t  stage;
+    uint8_t  id;           // trace_phase_t
+    uint16_t value;
+} trace_event_t;
+
+typedef struct {
+    trace_event_t     events[TRACE_RING_SIZE];
+    volatile uint32_t head;       // Written by the owning core only
+    volatile uint32_t tail;       // Written by the reader on core 0 only
+    volatile uint32_t dropped;    // Events lost to a full ring, never cleared
+} trace_ring_t;
+
+#if TRACE_STAGES
+extern trace_ring_t trace_rings[2];
+#endif
+
+// Core 0 has ISR and thread producers on the same ring, so the few stores of
+// an event run with interrupts off. Neither core ever waits on the other.
+static inline void trace_event(trace_stage_t stage, trace_phase_t id, uint16_t value) {
+#if TRACE_STAGES
+    if (TRACE_STAGES & (1u << stage)) {
+        trace_ring_t *ring      = &trace_rings[get_core_num()];
+        uint32_t      irq_state = save_and_disable_interrupts();
+        uint32_t      head      = ring->head;
+
+        if (head - ring->tail < TRACE_RING_SIZE) {
+            trace_event_t *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+            event->timestamp     = time_us_32();
+            event->stage         = (uint8_t)stage;
+            event->id            = (uint8_t)id;
+            event->value         = value;
+            __dmb();
+            ring->head = head + 1;
+        }
+        else {
+            ring->dropped++;
+        }
+        restore_interrupts(irq_state);
+    }
+#else
+    (void)stage;
+    (void)id;
+    (void)value;
+#endif
+}
+
+#define TRACE_BEGIN(stage)       trace_event(stage, TRACE_PHASE_BEGIN, 0)
+#define TRACE_END(stage, value)  trace_event(stage, TRACE_PHASE_END, (uint16_t)(value))
+#define TRACE_MARK(stage, value) trace_event(stage, TRACE_PHASE_INSTANT, (uint16_t)(value))
+
+uint32_t trace_read(uint core, trace_event_t *events, uint32_t max_events, uint32_t *dropped);
+
+// Execution time and interrupt entry latency histograms, in SysTick cycles.
+// SysTick is per core, so each region is only recorded on one core.
+// LATENCY_HIST=0 turns every probe into a no-op.
+#ifndef LATENCY_HIST
+#define LATENCY_HIST 0
+#endif
+
+#define LATENCY_BUCKETS 25    // Bucket b holds [2^(b-1), 2^b) cycles, SysTick is 24 bits
+
+typedef enum {
+    LAT_TX_ISR,          // timer0_irq_handler body
+    LAT_TX_ISR_ENTRY,    // Alarm to handler entry, 1 us resolution
+    LAT_SPK_CONVERT,     // Speaker packet read and conversion
+    LAT_MIC_FRAME,       // Mic packet cut and write
+    LAT_RX_DRAIN,        // Detector FIFO drain, core 1
+    LAT_E2E_QUEUE,       // Marker: USB OUT packet to the laser, speaker ring
+    LAT_E2E_LINK,        // Marker: laser to detector drain, PIO and optics
+    LAT_E2E_FIFO,        // Marker: detector to core 0, inter-core FIFO
+    LAT_E2E_JITTER,      // Marker: core 0 to the USB IN packet, jitter buffer
+    LAT_E2E_TOTAL,       // Marker: USB OUT to USB IN
+    LAT_N_REGIONS
+} latency_region_t;
+
+typedef struct {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} latency_hist_t;
+
+#if LATENCY_HIST
+#include "hardware/structs/systick.h"
+
+extern latency_hist_t latency_hists[LAT_N_REGIONS];
+
+static inline void latency_record(latency_region_t region, uint32_t cycles) {
+    latency_hist_t *hist   = &latency_hists[region];
+    uint32_t        bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+    hist->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    hist->count++;
+    if (cycles > hist->max) {
+        hist->max = cycles;
+    }
+}
+
+// SysTick counts down
+#define LATENCY_BEGIN(start)         uint32_t start = systick_hw->cvr
+#define LATENCY_END(region, start)   latency_record(region, (start - systick_hw->cvr) & 0xFFFFFF)
+#define LATENCY_RECORD(region, cyc)  latency_record(region, cyc)
+#else
+#define LATENCY_BEGIN(start)         ((void)0)
+#define LATENCY_END(region, start)   ((void)0)
+#define LATENCY_RECORD(region, cyc)  ((void)0)
+#endif
+
+void latency_init(void);    // Starts SysTick on the calling core
+void latency_reset(void);
+bool latency_format(latency_region_t region, char *line, size_t size);
 
 // Structure for microphone double buffering
 typedef struct {
@@ -105,6 +380,48 @@ typedef struct {
     volatile bool     ready;                                                   // Buffer ready for transmission
 } mic_pcm_buffer_t;
 
+// Jitter buffer between the detector and the USB IN stream
+typedef enum {
+    JB_PRIMING,     // Filling up to the target depth, sending silence
+    JB_PLAYING,
+    JB_UNDERRUN,    // Frame was short of samples and got padded
+    JB_N_STATES
+} jitter_state_t;
+
+typedef enum {
+    JB_UNDERRUN_REPEAT,      // Pad with the last sample and keep playing
+    JB_UNDERRUN_SILENCE,     // Pad with silence and keep playing
+    JB_UNDERRUN_REBUFFER,    // Pad with silence and prime to the target again
+} jitter_underrun_policy_t;
+
+typedef enum {
+    JB_OVERRUN_DROP_OLDEST,    // Full buffer drops the oldest sample
+    JB_OVERRUN_DROP_NEWEST,    // Full buffer drops the incoming sample
+    JB_OVERRUN_RESYNC,         // Drop back to the target depth at once
+} jitter_overrun_policy_t;
+
+typedef struct {
+    uint16_t                 target_depth;    // Samples buffered at the start of a USB frame
+    bool                     low_latency;     // Target one USB frame, overrides target_depth
+    jitter_underrun_policy_t underrun;
+    jitter_overrun_policy_t  overrun;
+} jitter_config_t;
+
+typedef struct {
+    uint16_t       depth;                              // Depth at the start of the last frame
+    uint16_t       depth_min;
+    uint16_t       depth_max;
+    uint16_t       target;
+    jitter_state_t state;
+    uint32_t       underruns;
+    uint32_t       overruns;
+    uint32_t       frames_in_state[JB_N_STATES];    // Time spent in each state, ms
+} jitter_stats_t;
+
+void jitter_buffer_configure(const jitter_config_t *config);
+void jitter_buffer_get_config(jitter_config_t *config);
+void jitter_buffer_get_stats(jitter_stats_t *stats, bool reset_min_max);
+
 // Structure for data exchange between cores
 typedef struct {
     uint32_t          buffer[2][48];
@@ -119,3 +436,51 @@ typedef struct {
 // Declaration of shared variables
 extern core_shared_buffer_t shared_ppm_data;
 extern volatile bool        sem_initialized;
+extern volatile uint8_t     ppm_code_bits;    // Code width for the current sample rate
+extern volatile uint32_t    current_sample_rate;
+
+// Receive statistics, core 1 (receiver.c)
+extern volatile uint32_t plc_concealed;
+extern volatile uint32_t plc_dropouts;
+extern volatile uint32_t plc_invalid;
+extern volatile bool     signal_lost;       // Beam lost, the mic stream is muted until relock
+extern volatile uint32_t signal_losses;
+extern volatile uint32_t signal_relocks;
+
+// Link quality estimate, written by core 1, every field is read on its own
+typedef struct {
+    volatile int32_t  pilot_mean_q8;       // Mean pilot timing error, counts Q8
+    volatile uint32_t pilot_var_q8;        // Pilot timing error variance, counts^2 Q8
+    volatile uint32_t invalid_rate_q16;    // Share of widths outside the code range, Q16
+    volatile uint32_t pilots;              // Pilots received
+    volatile uint32_t pilot_at_us;         // Timer at the last pilot, for the age of the estimate
+    volatile uint32_t pulse_high_q8;       // Mean first pulse high time, counts Q8 (DETECTOR_PACKED)
+    volatile uint32_t glitches;            // Rejected short pulses (DETECTOR_QUALIFIED)
+    volatile uint32_t phase_slips;         // Detector pairs that disagreed and were restarted (DETECTOR_DUAL)
+    volatile uint32_t lane_slips;          // Frames with lanes out of step at a pilot (PPM_LANES > 1)
+} link_quality_t;
+
+extern link_quality_t link_quality;
+extern volatile bool  detector_bias_comp;    // Measure codes rise to rise (DETECTOR_PACKED)
+
+uint detector_set_min_high(uint cycles);    // Returns the threshold in effect (DETECTOR_QUALIFIED)
+
+// Pulse arrival statistics from the timestamp SM, written by core 1
+typedef struct {
+    volatile uint32_t edges;             // Rising edges timestamped
+    volatile uint32_t frames;            // Symbol start edges on the grid
+    volatile uint32_t missing_starts;    // Symbol periods without a start edge
+    volatile uint32_t missing_ends;      // Symbols without their second pulse
+    volatile uint32_t extra_edges;       // More than one edge inside a symbol
+    volatile uint32_t overruns;          // Timestamps overwritten before they were read
+    volatile uint32_t period_q8;         // Transmitter symbol period, our clk_sys cycles Q8
+} pulse_timing_t;
+
+extern pulse_timing_t pulse_timing;
+
+// End to end latency markers. Core 1 tags the sample that stands in for a
+// received marker symbol with PPM_MARKER_FLAG on its way through the FIFO and
+// the jitter buffer, and leaves the detector time in marker_rx_us.
+#define PPM_MARKER_FLAG (1u << 31)
+
+extern volatile uint32_t marker_rx_us;
@@ -0,0 +1,76 @@
+#include "common.h"
+#include "hardware/structs/systick.h"
+#include <string.h>
+
+#if LATENCY_HIST
+latency_hist_t latency_hists[LAT_N_REGIONS];
+#endif
+
+static const char *const latency_names[LAT_N_REGIONS] = {
+    [LAT_TX_ISR]       = "tx_isr",
+    [LAT_TX_ISR_ENTRY] = "tx_isr_entry",
+    [LAT_SPK_CONVERT]  = "spk_convert",
+    [LAT_MIC_FRAME]    = "mic_frame",
+    [LAT_RX_DRAIN]     = "rx_drain",
+    [LAT_E2E_QUEUE]    = "e2e_queue",
+    [LAT_E2E_LINK]     = "e2e_link",
+    [LAT_E2E_FIFO]     = "e2e_fifo",
+    [LAT_E2E_JITTER]   = "e2e_jitter",
+    [LAT_E2E_TOTAL]    = "e2e_total",
+};
+
+void latency_init(void) {
+#if LATENCY_HIST
+    systick_hw->rvr = 0xFFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;    // Processor clock, no interrupt, enabled
+#endif
+}
+
+// Core 1 regions may lose a count that races with the clear, good enough here
+void latency_reset(void) {
+#if LATENCY_HIST
+    uint32_t irq_state = save_and_disable_interrupts();
+    memset(latency_hists, 0, sizeof(latency_hists));
+    restore_interrupts(irq_state);
+#endif
+}
+
+#if LATENCY_HIST
+// Upper bound of the bucket holding the given fraction (per mille) of samples
+static uint32_t latency_percentile(const latency_hist_t *hist, uint32_t per_mille) {
+    uint32_t rank = (uint32_t)(((uint64_t)hist->count * per_mille + 999) / 1000);
+    uint32_t seen = 0;
+
+    for (uint32_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            return b ? (1u << b) - 1 : 0;
+        }
+    }
+    return hist->max;
+}
+#endif
+
+// One report line per region, false once the region list is exhausted
+bool latency_format(latency_region_t region, char *line, size_t size) {
+    if (region >= LAT_N_REGIONS) {
+        return false;
+    }
+
+#if LATENCY_HIST
+    latency_hist_t hist;
+    uint32_t       irq_state = save_and_disable_interrupts();
+    hist                     = latency_hists[region];
+    restore_interrupts(irq_state);
+
+    uint32_t mhz = clock_get_hz(clk_sys) / 1000000;
+    uint32_t p50 = latency_percentile(&hist, 500);
+    uint32_t p99 = latency_percentile(&hist, 990);
+    snprintf(line, size, "lat %-12s n=%lu p50<=%lu p99<=%lu max=%lu cycles (max %lu us)\r\n",
+             latency_names[region], hist.count, p50, p99, hist.max, hist.max / mhz);
+#else
+    snprintf(line, size, "lat %-12s disabled, build with LATENCY_HIST=1\r\n", latency_names[region]);
+#endif
+    return true;
+}
@@ -1,13 +1,14 @@
 #include "common.h"
+#include "hardware/dma.h"
 #include "pico/sem.h"
 #include <pico/stdlib.h>
 
 static PIO           pio = pio0;
 static uint          sm_det;
+static uint          det_offset;
+static uint          det_entry;    // Where the detector program starts and restarts
 static volatile bool detector_running = false;
 
-// extern statistics_t statistics;
-
 // void update_measurements() {
 //     static uint16_t buffer_pos       = 0;
 //     static uint8_t  current_buffer   = 0;
@@ -77,27 +78,765 @@ static volatile bool detector_running = false;
 //     }
 // }
 
+// Packet loss concealment.
+// Valid samples are expected one sample period apart. When nothing valid has
+// arrived half a period after the next grid point (lost pulse, out of range
+// width, beam interrupted), a concealed sample is emitted in its place, so
+// core 0 still gets exactly one sample per period. Concealed samples start at
+// the last good code and decay toward the mid code (silence); once the signal
+// is back it is cross-faded in over PLC_XFADE_LEN samples.
+#define PLC_FADE_SHIFT 5     // Decay by 1/32 per concealed sample
+#define PLC_XFADE_LEN  16    // Samples to cross-fade back to the received signal
+
+volatile uint32_t plc_concealed = 0;    // Samples generated by concealment
+volatile uint32_t plc_dropouts  = 0;    // Gaps concealed
+volatile uint32_t plc_invalid   = 0;    // Widths outside the code range
+
+static bool     plc_active     = false;    // Grid is valid, set by the first good sample
+static bool     plc_concealing = false;
+static uint32_t plc_rate;
+static uint32_t plc_period_q16;    // Sample period, us Q16
+static uint32_t plc_grid_us;       // Time of the last emitted sample
+static uint32_t plc_grid_frac;     // Fraction of a microsecond, Q16
+static uint32_t plc_last;          // Last emitted code
+static uint16_t plc_xfade;         // Cross-fade samples left
+static bool     plc_mark;          // Tag the next emitted sample with PPM_MARKER_FLAG
+
+volatile uint32_t marker_rx_us;
+
+// Counters of the current pass, published to core1_stats once at its end so
+// the sequence counter is odd only for the few stores of the publish
+static statistics_t rx_batch;
+
+static void emit_sample(uint32_t code) {
+    if (plc_mark) {
+        plc_mark  = false;
+        code     |= PPM_MARKER_FLAG;
+    }
+    if (multicore_fifo_wready()) {
+        multicore_fifo_push_blocking(code);
+        rx_batch.total_fifo_pushed++;
+    }
+    else {
+        rx_batch.total_fifo_dropped++;
+    }
+}
+
+// Time since the last emitted sample, Q16 us
+static int32_t plc_elapsed_q16(uint32_t now) {
+    uint32_t us = now - plc_grid_us;
+    if (us >= 0x8000) {
+        return INT32_MAX;
+    }
+    return (int32_t)((us << 16) - plc_grid_frac);
+}
+
+static void plc_receive(uint32_t code, uint32_t now) {
+    if (plc_xfade) {
+        int32_t mid     = (int32_t)ppm_audio_span(ppm_code_bits) / 2;
+        int32_t conceal = (int32_t)plc_last - (((int32_t)plc_last - mid) >> PLC_FADE_SHIFT);
+        int32_t k       = PLC_XFADE_LEN - plc_xfade--;
+
+        plc_last = (uint32_t)((conceal * (PLC_XFADE_LEN - k) + (int32_t)code * k) / PLC_XFADE_LEN);
+    }
+    else {
+        plc_last = code;
+    }
+    emit_sample(plc_last);
+
+    // Real arrivals re-anchor the grid
+    plc_grid_us    = now;
+    plc_grid_frac  = 0;
+    plc_active     = true;
+    plc_concealing = false;
+}
+
+static void plc_conceal(uint32_t now) {
+    int32_t elapsed = plc_elapsed_q16(now);
+
+    if (!plc_active || elapsed < (int32_t)(plc_period_q16 + plc_period_q16 / 2)) {
+        return;
+    }
+
+    // Do not burst to catch up after a long stall, restart the grid instead
+    if (elapsed >= (int32_t)(3 * plc_period_q16)) {
+        plc_grid_us   = now;
+        plc_grid_frac = 0;
+    }
+    else {
+        uint32_t frac = plc_grid_frac + plc_period_q16;
+        plc_grid_us  += frac >> 16;
+        plc_grid_frac = frac & 0xFFFF;
+    }
+
+    // One period is a frame, a sample per lane
+    int32_t mid = (int32_t)ppm_audio_span(ppm_code_bits) / 2;
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        plc_last = (uint32_t)((int32_t)plc_last - (((int32_t)plc_last - mid) >> PLC_FADE_SHIFT));
+        emit_sample(plc_last);
+    }
+    TRACE_MARK(TRACE_PLC, plc_last);
+
+    plc_concealed += PPM_LANES;
+    if (!plc_concealing) {
+        plc_concealing = true;
+        plc_dropouts++;
+    }
+    plc_xfade = PLC_XFADE_LEN;
+}
+
+// Link quality.
+// O(1) per width: exponential moving averages of the pilot timing error,
+// its variance and the share of out of range widths. SNR and ENOB are
+// derived from these on request, see telemetry_report().
+#define LQ_PILOT_SHIFT   5     // Average over ~32 pilots
+#define LQ_INVALID_SHIFT 10    // Average over ~1024 widths
+
+link_quality_t link_quality;
+
+static void lq_pilot(uint32_t width, uint32_t code) {
+    int32_t mean  = link_quality.pilot_mean_q8;
+    int32_t delta = ((int32_t)width - (int32_t)code) * 256 - mean;
+    int32_t var   = (int32_t)link_quality.pilot_var_q8;
+
+    mean += delta >> LQ_PILOT_SHIFT;
+    var  += (((delta * delta) >> 8) - var) >> LQ_PILOT_SHIFT;
+
+    link_quality.pilot_mean_q8 = mean;
+    link_quality.pilot_var_q8  = (uint32_t)var;
+    link_quality.pilot_at_us   = time_us_32();
+    link_quality.pilots++;
+}
+
+static void lq_width(bool invalid) {
+    int32_t rate = (int32_t)link_quality.invalid_rate_q16;
+    rate += ((invalid ? 1 << 16 : 0) - rate) >> LQ_INVALID_SHIFT;
+    link_quality.invalid_rate_q16 = (uint32_t)rate;
+}
+
+// Pulse high time.
+// With DETECTOR_PACKED every width also carries how long the first pulse of
+// the pair stayed high. A weak pulse crosses the threshold late and falls
+// early, a stretched one falls late; either way the falling edge moves and
+// the pause after it moves the other way. The high time is averaged, and
+// with detector_bias_comp its deviation from the average is added back to
+// the pause: the code is then set by the two rising edges only, and the
+// MIN_TACKT calibration against the average pulse still holds.
+#define PULSE_HIGH_SHIFT 8    // Average over ~256 pulses
+
+volatile bool detector_bias_comp;
+
+static uint32_t detector_unpack(uint32_t word) {
+#if DETECTOR_MODE == DETECTOR_PACKED
+    uint32_t high  = word >> 16;
+    uint32_t pause = word & 0xFFFF;
+    int32_t  mean  = (int32_t)link_quality.pulse_high_q8;
+
+    if (mean == 0) {
+        mean = (int32_t)(high << 8);
+    }
+    mean += ((int32_t)(high << 8) - mean) >> PULSE_HIGH_SHIFT;
+    link_quality.pulse_high_q8 = (uint32_t)mean;
+
+    if (detector_bias_comp) {
+        pause = (uint32_t)((int32_t)pause + (int32_t)high - ((mean + 128) >> 8));
+    }
+    return pause;
+#else
+    return word;
+#endif
+}
+
+// Glitch threshold.
+// pulse_detector_qualified checks the pin every 2 cycles starting 2 cycles
+// after the edge, so "set x n" accepts pulses of at least 2 * n + 3 cycles.
+// The threshold is rewritten in instruction memory, which also works while
+// the detector runs; a pulse being qualified just then sees either value.
+// A spike inside the pause pushes ~X, the loops it had left of n.
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+#define GLITCH_WORD_MIN 0xFFFFFFE0u    // ~31
+
+static volatile uint8_t glitch_loops;    // n of the threshold in effect
+static uint32_t         glitch_stall;    // Counts to add to the pause being measured
+#endif
+
+uint detector_set_min_high(uint cycles) {
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+    uint n = cycles > 3 ? (cycles - 3) / 2 : 0;
+    if (n > 31) {
+        n = 31;
+    }
+    uint16_t instr = (uint16_t)pio_encode_set(pio_x, n);
+    glitch_loops   = (uint8_t)n;
+    pio->instr_mem[det_offset + pulse_detector_qualified_offset_first_threshold]  = instr;
+    pio->instr_mem[det_offset + pulse_detector_qualified_offset_second_threshold] = instr;
+    return 2 * n + 3;
+#else
+    return 0;
+#endif
+}
+
+#if DETECTOR_MODE == DETECTOR_DUAL
+// Dual phase.
+// Both detectors measure every pair, the late one sampling the end of the
+// pause one cycle after the early one. So the early count is the late one or
+// one more, and their sum is the pause in cycles. Anything else means one of
+// them lost a pair; both restart together and lock to the next pair.
+static uint sm_det_late;
+#endif
+
+#if PPM_LANES > 1
+// Lanes.
+// Every lane has a detector SM and a short queue, so a frame can be put
+// together once each lane has a word and a lane can wait while the others
+// are read on. Pilots go out on all lanes of one frame. A lane that lost a
+// symbol shows its pilot a frame early; when only some lanes show one, those
+// are held (their slot repeats the last sample) until the rest catch up.
+// After LANE_MAX_SKEW frames the wait is given up and the lanes run on as
+// they are until the next pilot.
+#define LANE_QUEUE    8              // Words per lane, a power of two
+#define LANE_MAX_SKEW 2              // Frames a pilot lane waits for the others
+#define LANE_HELD     0xFFFFFFFEu    // Slot of a held lane
+
+static uint     sm_lane[PPM_LANES];
+static uint32_t lane_queue[PPM_LANES][LANE_QUEUE];
+static uint8_t  lane_head[PPM_LANES];    // Free running, words taken
+static uint8_t  lane_tail[PPM_LANES];    // Free running, words queued
+static uint32_t lane_frame[PPM_LANES];
+static uint8_t  lane_next = PPM_LANES;    // Next slot of lane_frame to hand out
+static uint8_t  lane_skew;                // Frames the pilot lanes have waited
+
+static void lanes_reset(void) {
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        lane_head[lane] = 0;
+        lane_tail[lane] = 0;
+    }
+    lane_next = PPM_LANES;
+    lane_skew = 0;
+}
+#endif
+
+// Detector SMs, started and restarted together
+static uint32_t detector_mask(void) {
+#if DETECTOR_MODE == DETECTOR_DUAL
+    return (1u << sm_det) | (1u << sm_det_late);
+#elif PPM_LANES > 1
+    uint32_t mask = 0;
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        mask |= 1u << sm_lane[lane];
+    }
+    return mask;
+#else
+    return 1u << sm_det;
+#endif
+}
+
+// pulse_detector takes its phase in X and pulls its timeout once it starts
+static void detector_load_timeout(void) {
+#if PPM_LANES > 1
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        pio_sm_exec(pio, sm_lane[lane], pio_encode_set(pio_x, 0));
+        pio_sm_put(pio, sm_lane[lane], DETECTOR_TIMEOUT_COUNTS);
+    }
+#elif DETECTOR_MODE == DETECTOR_PAUSE || DETECTOR_MODE == DETECTOR_DUAL
+    pio_sm_exec(pio, sm_det, pio_encode_set(pio_x, 0));
+    pio_sm_put(pio, sm_det, DETECTOR_TIMEOUT_COUNTS);
+#endif
+#if DETECTOR_MODE == DETECTOR_DUAL
+    pio_sm_exec(pio, sm_det_late, pio_encode_set(pio_x, 1));
+    pio_sm_put(pio, sm_det_late, DETECTOR_TIMEOUT_COUNTS);
+#endif
+}
+
+// Start over at a random point of the pulse train, which is how a detector
+// measuring the gap between pairs instead of the pause inside them moves on
+static void detector_restart(void) {
+    uint32_t mask = detector_mask();
+
+    pio_set_sm_mask_enabled(pio, mask, false);
+    pio_restart_sm_mask(pio, mask);
+    for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+        if (mask & (1u << sm)) {
+            pio_sm_clear_fifos(pio, sm);
+            pio_sm_exec(pio, sm, pio_encode_jmp(det_entry));
+        }
+    }
+#if PPM_LANES > 1
+    lanes_reset();
+#endif
+    detector_load_timeout();
+    pio_set_sm_mask_enabled(pio, mask, true);
+}
+
+// Signal loss.
+// A detector timeout mutes the mic stream (core 0 watches signal_lost) and
+// stops concealment. The detector keeps looking by itself; the link counts as
+// back after RELOCK_VALID widths in a row that decode. A run of RELOCK_INVALID
+// widths that do not decode means the detector took the second pulse of a
+// pair for the first and measures the gaps, so it is restarted.
+#define RELOCK_VALID   16
+#define RELOCK_INVALID 8
+
+volatile bool     signal_lost    = false;
+volatile uint32_t signal_losses  = 0;
+volatile uint32_t signal_relocks = 0;
+
+static uint8_t relock_valid;
+static uint8_t relock_invalid;
+
+static void signal_loss(void) {
+    if (!signal_lost) {
+        signal_lost = true;
+        signal_losses++;
+    }
+    relock_valid   = 0;
+    relock_invalid = 0;
+    plc_active     = false;
+}
+
+static void signal_track(bool valid) {
+    if (!signal_lost) {
+        return;
+    }
+    if (!valid) {
+        relock_valid = 0;
+        if (++relock_invalid >= RELOCK_INVALID) {
+            relock_invalid = 0;
+            detector_restart();
+        }
+    }
+    else if (++relock_valid >= RELOCK_VALID) {
+        relock_invalid = 0;
+        signal_lost    = false;
+        signal_relocks++;
+    }
+}
+
+static inline uint32_t detector_code(uint32_t width) {
+    return (width + DETECTOR_TACKT) - MIN_INTERVAL_CYCLES;
+}
+
+#if PPM_LANES > 1
+// Move what the detectors have into the lane queues, false on signal loss.
+// A full queue means the other lanes stopped delivering, the frames start over.
+static bool lanes_fill(void) {
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        while (!pio_sm_is_rx_fifo_empty(pio, sm_lane[lane])) {
+            uint32_t raw = pio_sm_get(pio, sm_lane[lane]);
+            if (raw == DETECTOR_LOST) {
+                signal_loss();
+                lanes_reset();
+                return false;
+            }
+            if ((uint8_t)(lane_tail[lane] - lane_head[lane]) >= LANE_QUEUE) {
+                link_quality.lane_slips++;
+                lanes_reset();
+            }
+            lane_queue[lane][lane_tail[lane]++ & (LANE_QUEUE - 1)] = DETECTOR_TIMEOUT_COUNTS - raw;
+        }
+    }
+    return true;
+}
+
+// Take the next frame off the lane queues, false until every lane has a word
+static bool lanes_frame(void) {
+    uint8_t bits   = ppm_code_bits;
+    uint8_t pilots = 0;
+
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        if (lane_head[lane] == lane_tail[lane]) {
+            return false;
+        }
+        uint32_t width = lane_queue[lane][lane_head[lane] & (LANE_QUEUE - 1)];
+        if (ppm_is_symbol(detector_code(width), ppm_pilot_code(bits), bits)) {
+            pilots |= 1u << lane;
+        }
+    }
+
+    bool hold = pilots && pilots != (1u << PPM_LANES) - 1 && lane_skew < LANE_MAX_SKEW;
+    if (!hold) {
+        lane_skew = 0;
+    }
+    else if (lane_skew++ == 0) {
+        link_quality.lane_slips++;
+    }
+
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        if (hold && (pilots & (1u << lane))) {
+            lane_frame[lane] = LANE_HELD;
+        }
+        else {
+            lane_frame[lane] = lane_queue[lane][lane_head[lane]++ & (LANE_QUEUE - 1)];
+        }
+    }
+    lane_next = 0;
+    return true;
+}
+#endif
+
+// Next detector word, false if there is none yet
+static bool detector_read(uint32_t *word) {
+#if PPM_LANES > 1
+    // Words of a frame are handed out in lane order, which is sample order
+    if (lane_next == PPM_LANES && !(lanes_fill() && lanes_frame())) {
+        return false;
+    }
+    *word = lane_frame[lane_next++];
+    return true;
+#elif DETECTOR_MODE == DETECTOR_DUAL
+    if (pio_sm_is_rx_fifo_empty(pio, sm_det) || pio_sm_is_rx_fifo_empty(pio, sm_det_late)) {
+        return false;
+    }
+    uint32_t early = pio_sm_get(pio, sm_det);
+    uint32_t late  = pio_sm_get(pio, sm_det_late);
+    if (early == DETECTOR_LOST && late == DETECTOR_LOST) {
+        signal_loss();
+        return false;
+    }
+    // Both hold what is left of the timeout, the early count is the larger one
+    if (early == DETECTOR_LOST || late == DETECTOR_LOST || late - early > 1) {
+        link_quality.phase_slips++;
+        detector_restart();
+        return false;
+    }
+    *word = 2 * DETECTOR_TIMEOUT_COUNTS - early - late;
+    return true;
+#else
+    if (pio_sm_is_rx_fifo_empty(pio, sm_det)) {
+        return false;
+    }
+    *word = pio_sm_get(pio, sm_det);
+#if DETECTOR_MODE == DETECTOR_PAUSE
+    if (*word == DETECTOR_LOST) {
+        signal_loss();
+        return false;
+    }
+    *word = DETECTOR_TIMEOUT_COUNTS - *word;
+#endif
+    return true;
+#endif
+}
+
+// Arrival times.
+// The words drained in one pass queued up in the detector FIFOs since the
+// last one. The newest arrived about when the pass started and each one
+// before it a symbol period (a frame with lanes) earlier, so the PLC grid and
+// the marker time follow the pulses and not the moment this loop got to them.
+// Words that arrive during the pass are taken as they come.
+static uint32_t detector_backlog(void) {
+#if PPM_LANES > 1
+    uint32_t frames = UINT32_MAX;
+    for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+        uint32_t queued = pio_sm_get_rx_fifo_level(pio, sm_lane[lane]) + (uint8_t)(lane_tail[lane] - lane_head[lane]);
+        if (queued < frames) {
+            frames = queued;
+        }
+    }
+    return frames + (lane_next < PPM_LANES);
+#elif DETECTOR_MODE == DETECTOR_DUAL
+    uint32_t early = pio_sm_get_rx_fifo_level(pio, sm_det);
+    uint32_t late  = pio_sm_get_rx_fifo_level(pio, sm_det_late);
+    return early < late ? early : late;
+#else
+    return pio_sm_get_rx_fifo_level(pio, sm_det);
+#endif
+}
+
+static uint32_t detector_arrival(uint32_t drain_us, uint32_t backlog, uint32_t slot) {
+    uint32_t frame = slot / PPM_LANES;
+    if (frame >= backlog) {
+        return time_us_32();
+    }
+    return drain_us - (uint32_t)(((uint64_t)(backlog - 1 - frame) * plc_period_q16) >> 16);
+}
+
+static void statistics_publish(void) {
+    if (!rx_batch.total_received && !rx_batch.total_fifo_pushed && !rx_batch.total_fifo_dropped) {
+        return;
+    }
+    statistics_begin(&core1_stats);
+    core1_stats.total_received += rx_batch.total_received;
+    core1_stats.total_ppm_received += rx_batch.total_ppm_received;
+    core1_stats.total_summed_ppm_in += rx_batch.total_summed_ppm_in;
+    core1_stats.total_fifo_pushed += rx_batch.total_fifo_pushed;
+    core1_stats.total_fifo_dropped += rx_batch.total_fifo_dropped;
+    statistics_end(&core1_stats);
+
+    rx_batch.total_received      = 0;
+    rx_batch.total_ppm_received  = 0;
+    rx_batch.total_summed_ppm_in = 0;
+    rx_batch.total_fifo_pushed   = 0;
+    rx_batch.total_fifo_dropped  = 0;
+}
+
 void update_measurements() {
-    while (detector_running && !pio_sm_is_rx_fifo_empty(pio, sm_det)) {
-        uint32_t measured_width  = pio_sm_get(pio, sm_det);
-        uint32_t corrected_width = (measured_width + MIN_TACKT) - MIN_INTERVAL_CYCLES;
+    if (plc_rate != current_sample_rate) {
+        plc_rate       = current_sample_rate;
+        plc_period_q16 = (uint32_t)(((uint64_t)1000000 * PPM_LANES << 16) / plc_rate);
+    }
+
+    LATENCY_BEGIN(drain_start);
+    uint16_t widths = 0;
+#if TRACE_STAGES
+    if (!pio_sm_is_rx_fifo_empty(pio, sm_det)) {
+        TRACE_BEGIN(TRACE_RX_DRAIN);
+    }
+#endif
+
+    uint32_t drain_us = time_us_32();
+    uint32_t backlog  = detector_backlog();
+    uint32_t slot     = 0;
+    uint32_t word;
+    while (detector_running && detector_read(&word)) {
+        uint32_t now = detector_arrival(drain_us, backlog, slot++);
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+        if (word == 0) {
+            // A spike before the first pulse, nothing was counted yet
+            link_quality.glitches++;
+            continue;
+        }
+        if (word >= GLITCH_WORD_MIN) {
+            // A spike inside the pause, the detector stopped counting while
+            // it qualified it; the pause it belongs to gets the time back
+            uint32_t left  = ~word;
+            glitch_stall  += 4 + (left < glitch_loops ? glitch_loops - left : 0);
+            link_quality.glitches++;
+            continue;
+        }
+        word         += glitch_stall;
+        glitch_stall  = 0;
+#endif
+#if PPM_LANES > 1
+        if (word == LANE_HELD) {
+            // A lane waiting for the others to reach the pilot, hold the last sample in its slot
+            if (plc_active) {
+                plc_receive(plc_last, now);
+            }
+            continue;
+        }
+#endif
+        uint32_t measured_width  = detector_unpack(word);
+        uint32_t corrected_width = detector_code(measured_width);
+
+        uint8_t  bits            = ppm_code_bits;
+        uint32_t pilot           = ppm_pilot_code(bits);
+
+        rx_batch.total_received++;
+        widths++;
+        if (ppm_is_symbol(corrected_width, pilot, bits)) {
+            // The pilot replaced a sample, hold the last one in its slot
+            lq_pilot(corrected_width, pilot);
+            lq_width(false);
+            if (plc_active) {
+                plc_receive(plc_last, now);
+            }
+        }
+        else if (ppm_is_symbol(corrected_width, ppm_marker_code(bits), bits)) {
+            // Same for a marker, and tag the held sample for core 0
+            lq_width(false);
+            if (plc_active) {
+                marker_rx_us = now;
+                plc_mark     = true;
+                plc_receive(plc_last, now);
+            }
+        }
+        else if (corrected_width > 0 && corrected_width < ppm_audio_span(bits)) {
+            lq_width(false);
+            rx_batch.total_ppm_received++;
+            rx_batch.total_summed_ppm_in += corrected_width;
+            plc_receive(corrected_width, now);
+        }
+        else {
+            // Zero is the idle pulse pair, anything else is off the code range
+            lq_width(corrected_width != 0);
+            plc_invalid++;
+            signal_track(corrected_width == 0);
+            continue;
+        }
+        signal_track(true);
+    }
+
+    plc_conceal(time_us_32());
+
+    statistics_publish();
+
+    if (widths) {
+        TRACE_END(TRACE_RX_DRAIN, widths);
+        LATENCY_END(LAT_RX_DRAIN, drain_start);
+    }
+}
+
+// Pulse timestamps.
+// pulse_timestamp pushes a free running count at every rising edge and DMA
+// copies them into a ring with no CPU involvement; transfer_count counts the
+// words written. Each symbol is a start pulse on the symbol grid and an end
+// pulse after the code pause, so start edges are the ones within an eighth
+// of a period of the predicted grid point. The grid is re-anchored on every
+// start edge and its period follows the measured one, which makes it the
+// transmitter symbol clock in our clk_sys cycles. With a constant code the
+// end pulses are just as regular and the grid may lock to them instead; the
+// period is the same either way.
+#define PULSE_TS_RING_BITS   12    // Ring of 1 << 12 bytes
+#define PULSE_TS_RING_WORDS  ((1u << PULSE_TS_RING_BITS) / 4)
+#define PULSE_TS_CYCLES      2     // Cycles per count
+#define PULSE_TS_EDGE_CYCLES 3     // Extra cycles of the push path
+#define PULSE_TS_LOOP_SHIFT  6     // Period follows 1/64 of each error
+#define PULSE_TS_MAX_GAP     64    // Missed periods that restart the grid
 
-        if (corrected_width > 0 && corrected_width <= MAX_CODE) {
-            if (multicore_fifo_wready()) {
-                multicore_fifo_push_blocking(corrected_width);
+static uint32_t pulse_ts_ring[PULSE_TS_RING_WORDS] __attribute__((aligned(1 << PULSE_TS_RING_BITS)));
+static uint     sm_ts;
+static int      dma_ts = -1;
+static uint32_t ts_read;          // Words consumed, compared with words written
+static uint32_t ts_last_raw;
+static uint32_t ts_now;           // Edge time on a cycle timeline rebuilt from the counts
+static uint32_t ts_next_start;    // Predicted start edge
+static uint32_t ts_rate;
+static uint8_t  ts_inner;         // Edges since the last start edge
+static bool     ts_locked;
+
+pulse_timing_t pulse_timing;
+
+static void pulse_ts_restart(void) {
+    ts_locked              = false;
+    ts_rate                = current_sample_rate;
+    pulse_timing.period_q8 = (uint32_t)(((uint64_t)clock_get_hz(clk_sys) << 8) / ts_rate);
+}
+
+static void pulse_ts_edge(uint32_t raw) {
+    ts_now      += PULSE_TS_CYCLES * (raw - ts_last_raw) + PULSE_TS_EDGE_CYCLES;
+    ts_last_raw  = raw;
+    pulse_timing.edges++;
+
+    uint32_t period = pulse_timing.period_q8 >> 8;
+    int32_t  error  = (int32_t)(ts_now - ts_next_start);
+    int32_t  tol    = (int32_t)period / 8;
+
+    if (ts_locked && error < -tol) {
+        if (++ts_inner > 1) {
+            pulse_timing.extra_edges++;
+        }
+        return;
+    }
+
+    if (ts_locked && error > tol) {
+        // Late: the start edges of the periods passed since were lost. The
+        // grid moves on by whole periods and only an edge that lands on it
+        // re-anchors it; the end pulse of a symbol that lost its start does
+        // not, so the pause does not get into the grid or the period.
+        uint32_t missed = ((uint32_t)(error - tol) + period - 1) / period;
+        pulse_timing.missing_starts += missed;
+        if (missed > PULSE_TS_MAX_GAP) {
+            pulse_ts_restart();
+        }
+        else {
+            ts_next_start += missed * period;
+            error         -= (int32_t)(missed * period);
+            if (error < -tol) {
+                ts_inner = 1;
+                return;
             }
+            pulse_timing.frames++;
+            pulse_timing.period_q8 = (uint32_t)((int32_t)pulse_timing.period_q8 + ((error * 256) >> PULSE_TS_LOOP_SHIFT));
+        }
+    }
+    else if (ts_locked) {
+        if (ts_inner == 0) {
+            pulse_timing.missing_ends++;
+        }
+        pulse_timing.frames++;
+        pulse_timing.period_q8 = (uint32_t)((int32_t)pulse_timing.period_q8 + ((error * 256) >> PULSE_TS_LOOP_SHIFT));
+    }
+
+    // Re-anchor the grid on this edge
+    ts_locked     = true;
+    ts_inner      = 0;
+    ts_next_start = ts_now + (pulse_timing.period_q8 >> 8);
+}
+
+static void pulse_ts_task(void) {
+    if (dma_ts < 0) {
+        return;
+    }
+    if (ts_rate != current_sample_rate) {
+        pulse_ts_restart();
+    }
+
+    // After 2^32 - 1 words the channel stops, start it over
+    if (!dma_channel_is_busy((uint)dma_ts)) {
+        dma_channel_set_write_addr((uint)dma_ts, pulse_ts_ring, false);
+        dma_channel_set_trans_count((uint)dma_ts, 0xFFFFFFFF, true);
+        ts_read = 0;
+        pulse_ts_restart();
+        return;
+    }
+
+    uint32_t written = 0xFFFFFFFF - dma_channel_hw_addr((uint)dma_ts)->transfer_count;
+    if (written - ts_read > PULSE_TS_RING_WORDS) {
+        pulse_timing.overruns += written - ts_read - PULSE_TS_RING_WORDS;
+        ts_read = written - PULSE_TS_RING_WORDS;
+        pulse_ts_restart();
+    }
+
+    while (ts_read != written) {
+        uint32_t raw = pulse_ts_ring[ts_read++ & (PULSE_TS_RING_WORDS - 1)];
+        if (!ts_locked) {
+            ts_last_raw = raw;    // First edge after a restart only sets the count origin
         }
+        pulse_ts_edge(raw);
     }
 }
 
+void init_pulse_timestamps(float freq) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+    sm_ts       = pio_claim_unused_sm(pio, true);
+    uint offset = pio_add_program(pio, &pulse_timestamp_program);
+#pragma GCC diagnostic pop
+    pio_sm_config c = pulse_timestamp_program_get_default_config(offset);
+
+    sm_config_set_jmp_pin(&c, PULSE_DET_PIN);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / freq);
+    pio_sm_init(pio, sm_ts, offset, &c);
+
+    dma_ts               = dma_claim_unused_channel(true);
+    dma_channel_config d = dma_channel_get_default_config((uint)dma_ts);
+    channel_config_set_transfer_data_size(&d, DMA_SIZE_32);
+    channel_config_set_read_increment(&d, false);
+    channel_config_set_write_increment(&d, true);
+    channel_config_set_ring(&d, true, PULSE_TS_RING_BITS);
+    channel_config_set_dreq(&d, pio_get_dreq(pio, sm_ts, false));
+    dma_channel_configure((uint)dma_ts, &d, pulse_ts_ring, &pio->rxf[sm_ts], 0xFFFFFFFF, true);
+
+    pulse_ts_restart();
+}
+
 // Initialize PIO for pulse detector
 void init_pulse_detector(float freq) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-conversion"
     sm_det      = pio_claim_unused_sm(pio, true);
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+    uint offset = pio_add_program(pio, &pulse_detector_qualified_program);
+#pragma GCC diagnostic pop
+    pio_sm_config c = pulse_detector_qualified_program_get_default_config(offset);
+#elif DETECTOR_MODE == DETECTOR_PACKED
+    uint offset = pio_add_program(pio, &pulse_detector_packed_program);
+#pragma GCC diagnostic pop
+    pio_sm_config c = pulse_detector_packed_program_get_default_config(offset);
+    // High count first, so it ends up in the upper half
+    sm_config_set_in_shift(&c, false, false, 32);
+#else
     uint offset = pio_add_program(pio, &pulse_detector_program);
 #pragma GCC diagnostic pop
     pio_sm_config c = pulse_detector_program_get_default_config(offset);
+#endif
+    det_offset = offset;
+    det_entry  = offset;
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+    det_entry += pulse_detector_qualified_offset_start;
+    detector_set_min_high(DETECTOR_MIN_HIGH_CYCLES);
+#endif
 
     sm_config_set_in_pins(&c, PULSE_DET_PIN);
     sm_config_set_jmp_pin(&c, PULSE_DET_PIN);
@@ -105,21 +844,64 @@ void init_pulse_detector(float freq) {
     pio_sm_set_consecutive_pindirs(pio, sm_det, PULSE_DET_PIN, 1, false);
 
     sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / freq);
-    pio_sm_init(pio, sm_det, offset, &c);
+    pio_sm_init(pio, sm_det, det_entry, &c);
+
+#if PPM_LANES > 1
+    // Same program and config on the pin of every lane
+    static const uint det_pins[] = LANE_DET_PINS;
+
+    sm_lane[0] = sm_det;
+    for (uint8_t lane = 1; lane < PPM_LANES; lane++) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+        sm_lane[lane] = pio_claim_unused_sm(pio, true);
+#pragma GCC diagnostic pop
+        sm_config_set_in_pins(&c, det_pins[lane]);
+        sm_config_set_jmp_pin(&c, det_pins[lane]);
+        pio_gpio_init(pio, det_pins[lane]);
+        pio_sm_set_consecutive_pindirs(pio, sm_lane[lane], det_pins[lane], 1, false);
+        pio_sm_init(pio, sm_lane[lane], det_entry, &c);
+    }
+#endif
+
+#if DETECTOR_MODE == DETECTOR_DUAL
+    // Same program and config, the phase comes from X
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+    sm_det_late = pio_claim_unused_sm(pio, true);
+#pragma GCC diagnostic pop
+    pio_sm_init(pio, sm_det_late, det_entry, &c);
+#endif
 }
 
 void start_detector() {
-    pio_sm_clear_fifos(pio, sm_det);
-    pio_sm_set_enabled(pio, sm_det, true);
+    uint32_t mask = detector_mask();
+    for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+        if (mask & (1u << sm)) {
+            pio_sm_clear_fifos(pio, sm);
+        }
+    }
+#if PPM_LANES == 1
+    pio_sm_clear_fifos(pio, sm_ts);
+    mask |= 1u << sm_ts;
+#endif
+    detector_load_timeout();
+    pio_set_sm_mask_enabled(pio, mask, true);
     detector_running = true;
 }
 
 void second_core_main() {
+    latency_init();
     init_pulse_detector(PIO_FREQ);
+#if PPM_LANES == 1
+    // The lanes take the SM it would run on
+    init_pulse_timestamps(PIO_FREQ);
+#endif
     start_detector();
 
     while (1) {
         update_measurements();
+        pulse_ts_task();
     }
 }
 
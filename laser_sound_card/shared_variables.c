@@ -4,4 +4,7 @@
 core_shared_buffer_t shared_ppm_data __attribute__((section(".scratch_x")));
 
 // Флаг, указывающий, что обмен через семафоры инициализирован
-volatile bool sem_initialized = false;
\ No newline at end of file
+volatile bool sem_initialized = false;
+
+// Ширина кода PPM для текущей частоты дискретизации (см. ppm_code_bits_for)
+volatile uint8_t ppm_code_bits = PPM_CODE_BITS_MAX;
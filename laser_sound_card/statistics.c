@@ -0,0 +1,85 @@
+#include "common.h"
+#include "hardware/sync.h"
+#include <string.h>
+
+// One instance per core, each in its own scratch bank, so counting on one
+// core never contends with the other core for the same SRAM bank.
+// Counters are plain non-atomic increments: every field has a single writer.
+statistics_t core0_stats __attribute__((section(".scratch_y")));
+statistics_t core1_stats __attribute__((section(".scratch_x")));
+
+static void statistics_add(statistics_t *dst, const statistics_t *src) {
+    dst->total_pcm_received += src->total_pcm_received;
+    dst->total_ppm_convert += src->total_ppm_convert;
+    dst->total_pcm_convert += src->total_pcm_convert;
+    dst->total_ppm_sent += src->total_ppm_sent;
+    dst->total_ppm_received += src->total_ppm_received;
+    dst->total_sent += src->total_sent;
+    dst->total_received += src->total_received;
+    dst->total_fifo_pushed += src->total_fifo_pushed;
+    dst->total_fifo_dropped += src->total_fifo_dropped;
+    dst->total_summed_ppm_out += src->total_summed_ppm_out;
+    dst->total_summed_ppm_in += src->total_summed_ppm_in;
+    dst->total_summed_ppm_in_usb += src->total_summed_ppm_in_usb;
+    dst->total_ticks_attempt_send_to_usb += src->total_ticks_attempt_send_to_usb;
+    dst->total_bytes_sent_to_usb += src->total_bytes_sent_to_usb;
+}
+
+// Delta in the counter's own width so wraps cancel, scaled in 64 bits so
+// a busy counter times 1000 does not overflow
+#define RATE(field) \
+    rate->field = (__typeof__(rate->field))((uint64_t)(__typeof__(rate->field))(cur->field - prev->field) * 1000 / interval_ms)
+
+static void statistics_rate(statistics_t *rate, const statistics_t *cur, const statistics_t *prev, uint32_t interval_ms) {
+    RATE(total_pcm_received);
+    RATE(total_ppm_convert);
+    RATE(total_pcm_convert);
+    RATE(total_ppm_sent);
+    RATE(total_ppm_received);
+    RATE(total_sent);
+    RATE(total_received);
+    RATE(total_fifo_pushed);
+    RATE(total_fifo_dropped);
+    RATE(total_summed_ppm_out);
+    RATE(total_summed_ppm_in);
+    RATE(total_summed_ppm_in_usb);
+    RATE(total_ticks_attempt_send_to_usb);
+    RATE(total_bytes_sent_to_usb);
+}
+
+#undef RATE
+
+// Core 0 only. Its own counters are copied with interrupts off (the transmit
+// ISR writes some of them), core 1's under its sequence counter.
+void statistics_snapshot(statistics_snapshot_t *snap) {
+    static statistics_t prev;
+    static uint32_t     prev_ms = 0;
+    statistics_t        c0, c1;
+    uint32_t            seq;
+
+    uint32_t irq_state = save_and_disable_interrupts();
+    c0                 = core0_stats;
+    restore_interrupts(irq_state);
+
+    do {
+        seq = core1_stats.seq;
+        __dmb();
+        c1 = core1_stats;
+        __dmb();
+    } while ((seq & 1) || seq != core1_stats.seq);
+
+    memset(&snap->total, 0, sizeof(snap->total));
+    statistics_add(&snap->total, &c0);
+    statistics_add(&snap->total, &c1);
+
+    uint32_t now      = to_ms_since_boot(get_absolute_time());
+    snap->interval_ms = now - prev_ms;
+    if (prev_ms && snap->interval_ms) {
+        statistics_rate(&snap->per_second, &snap->total, &prev, snap->interval_ms);
+    }
+    else {
+        memset(&snap->per_second, 0, sizeof(snap->per_second));
+    }
+    prev    = snap->total;
+    prev_ms = now;
+}
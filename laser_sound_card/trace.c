@@ -0,0 +1,38 @@
+#include "common.h"
+
+#if TRACE_STAGES
+
+trace_ring_t trace_rings[2];
+
+// Core 0 only. Copies up to max_events oldest events of one core's ring and
+// frees their slots. dropped is the running overflow count of that ring.
+uint32_t trace_read(uint core, trace_event_t *events, uint32_t max_events, uint32_t *dropped) {
+    trace_ring_t *ring  = &trace_rings[core];
+    uint32_t      tail  = ring->tail;
+    uint32_t      count = ring->head - tail;
+
+    __dmb();
+    if (count > max_events) {
+        count = max_events;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        events[i] = ring->events[(tail + i) & (TRACE_RING_SIZE - 1)];
+    }
+    __dmb();
+    ring->tail = tail + count;
+
+    *dropped = ring->dropped;
+    return count;
+}
+
+#else
+
+uint32_t trace_read(uint core, trace_event_t *events, uint32_t max_events, uint32_t *dropped) {
+    (void)core;
+    (void)events;
+    (void)max_events;
+    *dropped = 0;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+Декодер трассировки событий laser_sound (CDC интерфейс "Laser Telemetry")
+Снимает дамп командой "trace on" или читает сохранённый файл и пишет
+JSON в формате Chrome trace, который открывается в Perfetto / chrome://tracing
+Прошивка должна быть собрана с -DTRACE_STAGES=<маска стадий>
+"""
+
+import argparse
+import json
+import struct
+import time
+
+TRACE_MAGIC = b"TRCE"
+HEADER = struct.Struct("<4sBBxxI")
+EVENT = struct.Struct("<IBBH")
+
+# Порядок совпадает с trace_stage_t в common.h
+STAGES = ["tx_isr", "sof", "spk_rx", "mic_frame", "mic_task", "rx_drain", "plc"]
+PHASES = ["i", "B", "E"]
+CORES = ["core0 (USB, TX)", "core1 (RX)"]
+
+
+def capture(port, duration):
+    """Включить трассировку и собрать сырой поток с CDC порта"""
+    import serial
+
+    raw = bytearray()
+    with serial.Serial(port, timeout=0.1) as ser:
+        ser.write(b"trace on\r\n")
+        end = time.time() + duration
+        while time.time() < end:
+            raw += ser.read(4096)
+        ser.write(b"trace off\r\n")
+    return bytes(raw)
+
+
+def parse(raw):
+    """Найти кадры по магическому слову, текстовые строки между ними пропускаются"""
+    events = []
+    dropped = [0, 0]
+    pos = raw.find(TRACE_MAGIC)
+    while pos >= 0 and pos + HEADER.size <= len(raw):
+        _, core, count, drop = HEADER.unpack_from(raw, pos)
+        body = pos + HEADER.size
+        if core > 1 or body + count * EVENT.size > len(raw):
+            pos = raw.find(TRACE_MAGIC, pos + 1)
+            continue
+        for i in range(count):
+            ts, stage, phase, value = EVENT.unpack_from(raw, body + i * EVENT.size)
+            events.append((core, ts, stage, phase, value))
+        dropped[core] = drop
+        pos = raw.find(TRACE_MAGIC, body + count * EVENT.size)
+    return events, dropped
+
+
+def to_chrome(events):
+    """Перевести события в Chrome trace, time_us_32() разворачивается по переполнению"""
+    out = [
+        {"name": "thread_name", "ph": "M", "pid": 0, "tid": core, "args": {"name": name}}
+        for core, name in enumerate(CORES)
+    ]
+    last = [None, None]
+    wraps = [0, 0]
+    for core, ts, stage, phase, value in events:
+        if last[core] is not None and ts < last[core] and last[core] - ts > 0x80000000:
+            wraps[core] += 1
+        last[core] = ts
+        record = {
+            "name": STAGES[stage] if stage < len(STAGES) else "stage%d" % stage,
+            "ph": PHASES[phase] if phase < len(PHASES) else "i",
+            "ts": ts + (wraps[core] << 32),
+            "pid": 0,
+            "tid": core,
+            "args": {"value": value},
+        }
+        if record["ph"] == "i":
+            record["s"] = "t"
+        out.append(record)
+    return {"traceEvents": out}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Декодер трассировки laser_sound")
+    parser.add_argument("--port", "-p", type=str, help="CDC порт, например /dev/ttyACM0")
+    parser.add_argument("--input", "-i", type=str, help="Файл с сырым дампом вместо порта")
+    parser.add_argument(
+        "--duration", "-t", type=float, default=2.0, help="Длительность записи (с)"
+    )
+    parser.add_argument("--raw", type=str, help="Сохранить сырой дамп в файл")
+    parser.add_argument(
+        "--output", "-o", type=str, default="trace.json", help="Выходной JSON"
+    )
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input, "rb") as f:
+            raw = f.read()
+    elif args.port:
+        raw = capture(args.port, args.duration)
+    else:
+        parser.error("нужен --port или --input")
+
+    if args.raw:
+        with open(args.raw, "wb") as f:
+            f.write(raw)
+
+    events, dropped = parse(raw)
+    with open(args.output, "w") as f:
+        json.dump(to_chrome(events), f)
+
+    print(f"Событий: {len(events)}, потеряно в кольцах: core0={dropped[0]} core1={dropped[1]}")
+    print(f"Записано в {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,15 +1,20 @@
 #include "common.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/structs/usb.h"
+#include "hardware/sync.h"
 #include "hardware/uart.h"
 #include "pico/sem.h"
 #include "usb_descriptors.h"
 #include <bsp/board_api.h>
 #include <limits.h>
+#include <math.h>
 #include <string.h>
 
 // List of supported sample rates
-const uint32_t sample_rates[] = {44100, AUDIO_SAMPLE_RATE};
+const uint32_t sample_rates[] = {44100, AUDIO_SAMPLE_RATE, 88200, 96000};
 
-uint32_t current_sample_rate = AUDIO_SAMPLE_RATE;
+volatile uint32_t current_sample_rate = AUDIO_SAMPLE_RATE;
 
 #define UART_ID   uart0
 #define BAUD_RATE 115200
@@ -26,33 +31,208 @@ static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
 int8_t  mute[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX + 1];      // +1 for master channel 0
 int16_t volume[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX + 1];    // +1 for master channel 0
 
+// Volume: dB -> linear gain lookup (Q15), one entry per dB of attenuation
+static const uint16_t db_to_gain_q15[] = {
+    32768, 29205, 26029, 23198, 20675, 18427, 16423, 14637,
+    13045, 11627, 10362, 9235, 8231, 7336, 6538, 5827,
+    5193, 4629, 4125, 3677, 3277, 2920, 2603, 2320,
+    2068, 1843, 1642, 1464, 1305, 1163, 1036, 924,
+    823, 734, 654, 583, 519, 463, 413, 368,
+    328, 292, 260, 232, 207, 184, 164, 146,
+    130, 116, 104, 92, 82, 73, 65, 58,
+    52, 46, 41, 37, 33, 29, 26, 23,
+    21};
+
+#define GAIN_UNITY_Q24    (1 << 24)
+#define GAIN_SMOOTH_SHIFT 7    // One-pole smoothing, ~128 samples, avoids zipper noise
+
+// Target and smoothed per-channel gains (Q24), applied in the conversion loop
+static volatile int32_t gain_target[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX];
+static int32_t          gain_current[CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX];
+
 // Buffer for microphone data
-int32_t  mic_buf[CFG_TUD_AUDIO_FUNC_1_EP_IN_SW_BUF_SZ / 4];
-int16_t *mic_dst;
-// Buffer for speaker data
-int32_t spk_buf[CFG_TUD_AUDIO_FUNC_1_EP_OUT_SW_BUF_SZ / 4];
-// Speaker data size received in the last frame
-uint16_t spk_data_size;
+int32_t mic_buf[CFG_TUD_AUDIO_FUNC_1_EP_IN_SW_BUF_SZ / 4];
 // Resolution per format
 const uint8_t resolutions_per_format[CFG_TUD_AUDIO_FUNC_1_N_FORMATS] = {CFG_TUD_AUDIO_FUNC_1_FORMAT_1_RESOLUTION_RX,
                                                                         CFG_TUD_AUDIO_FUNC_1_FORMAT_2_RESOLUTION_RX};
+const uint8_t mic_resolutions_per_format[CFG_TUD_AUDIO_FUNC_1_N_FORMATS] = {CFG_TUD_AUDIO_FUNC_1_FORMAT_1_RESOLUTION_TX,
+                                                                            CFG_TUD_AUDIO_FUNC_1_FORMAT_2_RESOLUTION_TX};
 // Current resolution, update on format change
 uint8_t  current_resolution;
-uint16_t pcm_ticks_in_buffer = 0;
-
-// Double buffers for speaker (USB -> PPM)
-static spk_ppm_buffer_t spk_buffers[2];
-static volatile uint8_t current_spk_write_buffer = 0;    // Buffer for PPM preparation
-static volatile uint8_t current_spk_read_buffer  = 0;    // Buffer for reading in timer
+uint8_t  mic_resolution;
+
+// Format conversion kernels, picked once per alt-setting change.
+// Speaker: interleaved L/R USB frames -> PPM codes, returns number of codes.
+// src and dst may be the same buffer: a code is never wider than the frame it
+// is made from, so the output never overtakes the input.
+typedef uint16_t (*spk_kernel_t)(const void *src, uint16_t n_bytes, uint16_t *dst);
+// Microphone: PPM codes -> mono USB samples, returns number of bytes.
+typedef uint16_t (*mic_kernel_t)(const uint32_t *ppm, uint16_t count, void *dst);
+
+static spk_kernel_t spk_kernel;
+static mic_kernel_t mic_kernel;
+
+// Speaker code ring (USB -> PPM).
+// USB packets are read straight from the endpoint FIFO into a contiguous free
+// segment and converted to codes in place. A packet never straddles the end of
+// the ring: if it does not fit in the tail, the writer marks the end of valid
+// data and starts again from 0 (bip buffer). The timer ISR is the only reader.
+#define SPK_RING_SIZE 2048    // uint16_t slots, power of 2
+
+static uint16_t          spk_ring[SPK_RING_SIZE];
+static volatile uint16_t spk_ring_write = 0;                // Next free slot, USB callback only
+static volatile uint16_t spk_ring_read  = 0;                // Next code to send, timer ISR only
+static volatile uint16_t spk_ring_end   = SPK_RING_SIZE;    // End of valid data after the writer wrapped
+
+// Speaker ring statistics
+volatile uint32_t spk_lost_packets = 0;    // Packets dropped for any reason
+volatile uint32_t spk_overruns     = 0;    // Packets dropped because the ring was full
+volatile uint32_t spk_underruns    = 0;    // Timer ticks with no code to send while streaming
+
+static volatile bool spk_streaming = false;
+
+// Jitter buffer (PPM codes from core 1 -> USB IN).
+// mic_task drains the inter-core FIFO into it, one IN packet is cut per USB
+// frame in tud_sof_cb. Both run from the main loop, so no locking is needed.
+// Depth is measured at the start of a frame, before the packet is cut.
+#define JB_SIZE           512    // Power of 2
+#define JB_DEFAULT_TARGET 64     // Samples
+#define JB_TRIM_HYST      4      // Depth error tolerated before the packet size is trimmed
+
+static uint32_t        jb_queue[JB_SIZE];
+static uint16_t        jb_head     = 0;    // Free running, written by mic_task
+static uint16_t        jb_tail     = 0;    // Free running, read per USB frame
+static uint32_t        jb_rate_acc = 0;    // Sample rate accumulator, samples * 1000
+static jitter_state_t  jb_state    = JB_PRIMING;
+static jitter_config_t jb_config   = {
+    .target_depth = JB_DEFAULT_TARGET,
+    .low_latency  = false,
+    .underrun     = JB_UNDERRUN_REPEAT,
+    .overrun      = JB_OVERRUN_DROP_OLDEST};
+static jitter_stats_t jb_stats;
+static bool           mic_streaming = false;
 
 void led_blinking_task(void);
-void spk_task(void);
 void mic_task(void);
+void telemetry_task(void);
+void signal_status_task(void);
+
+static PIO      pio = pio1;
+static uint     sm_gen;
+static uint32_t lane_codes[PPM_LANES];    // Pause widths of the frame, lane order
+#if PPM_LANES > 1
+static int      dma_gen;
+#endif
+
+// Symbol pacing.
+// The timer ISR schedules alarms on an absolute timeline with a Q16 microsecond
+// period, so rates that are not a whole number of microseconds (44.1k, 96k)
+// keep their average and the error does not accumulate.
+static volatile uint32_t symbol_period_q16;                 // Timer microseconds per symbol, Q16
+static uint32_t          symbol_alarm_at;                   // Absolute time of the next alarm
+static uint32_t          symbol_phase_q16;                  // Fraction of a microsecond carried to the next alarm
+static uint16_t          pilot_count;                       // Frames since the last pilot
+static volatile bool     pilot_in_audio = PPM_LANES > 1;    // Pilots may replace samples, "pilot audio"
+
+// End to end latency markers.
+// Every marker_interval_ms one sample of the speaker stream is replaced by
+// the marker symbol. The sample the receiver holds in its slot carries
+// PPM_MARKER_FLAG through the FIFO and the jitter buffer to the USB IN
+// packet, with a timestamp taken at each stage. One marker is in flight at a
+// time; one that never comes back is counted as lost after MARKER_TIMEOUT_MS.
+#define MARKER_TIMEOUT_MS 1000
+
+typedef enum {
+    MARKER_IDLE,
+    MARKER_ARMED,     // Next speaker packet carries it
+    MARKER_QUEUED,    // Waiting in the speaker ring at marker_ring_pos
+    MARKER_SENT,      // On the way back from the receiver
+} marker_state_t;
+
+static volatile marker_state_t marker_state       = MARKER_IDLE;
+static uint32_t                marker_interval_ms = 0;    // 0 - off
+static uint32_t                marker_armed_ms;
+static uint16_t                marker_ring_pos;
+static uint32_t                marker_usb_out_us;
+static volatile uint32_t       marker_tx_us;
+static uint32_t                marker_fifo_us;
+static uint32_t                markers_sent     = 0;
+static uint32_t                markers_received = 0;
+static uint32_t                markers_lost     = 0;
+
+// Marker latency per stage in microseconds, built in every configuration.
+// Buckets are exact below MARKER_HIST_SUB us and then MARKER_HIST_SUB per
+// power of two, so a bucket is within 1/16 of its value up to 2^20 us, past
+// MARKER_TIMEOUT_MS.
+#define MARKER_HIST_SUB_BITS 4
+#define MARKER_HIST_SUB      (1u << MARKER_HIST_SUB_BITS)
+#define MARKER_HIST_OCTAVES  16
+#define MARKER_HIST_BUCKETS  (MARKER_HIST_SUB * (MARKER_HIST_OCTAVES + 1))
+#define MARKER_STAGES        (LAT_E2E_TOTAL - LAT_E2E_QUEUE + 1)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t buckets[MARKER_HIST_BUCKETS];
+} marker_hist_t;
+
+static marker_hist_t marker_hists[MARKER_STAGES];
+
+static const char *const marker_stage_names[MARKER_STAGES] = {"queue", "link", "fifo", "jb", "total"};
+
+// SOF discipline.
+// A second order loop locks a model of the 1 ms USB frame to the SOF
+// timestamps taken with the RP2040 timer. Its frequency term is the offset
+// of our timer against the host clock and scales the symbol period, so the
+// laser symbol rate follows the host and the speaker ring does not drift.
+// tud_sof_cb is deferred to tud_task in the main loop, so the timestamps are
+// taken in the USB interrupt instead, by a handler that runs after the
+// TinyUSB one, and looked up by frame number.
+#define SOF_KP_SHIFT     5      // Phase correction, 1/32 of the error per frame
+#define SOF_KI_SHIFT     14     // Frequency correction, ppm*256 per us of error
+#define SOF_PPM_LIMIT    (1000 * 256)
+#define SOF_RELOCK_US    500    // Phase error that restarts the loop
+#define SOF_MAX_GAP      32     // Frames missed before the loop restarts
+#define SOF_STAMPS       8      // Timestamps kept for the deferred callback, a power of two
+
+static bool     sof_locked = false;
+static uint32_t sof_last_frame;
+static int64_t  sof_predicted_q16;    // Model time of the last SOF, Q16 us
+
+static uint16_t          sof_irq_frame = 0xFFFF;    // Last frame number seen by sof_irq_handler
+static volatile uint32_t sof_stamp_us[SOF_STAMPS];
+static volatile uint16_t sof_stamp_frame[SOF_STAMPS];
+
+volatile int32_t  sof_ppm_error_q8 = 0;    // Timer vs host clock, ppm * 256 (positive: our timer is fast)
+volatile uint32_t sof_relocks      = 0;
+volatile uint32_t pacing_slips     = 0;    // Alarms that were already in the past and got rescheduled
+
+// The TinyUSB handler has already read SOF_RD, which clears the SOF
+// interrupt, so a new frame number is how a SOF shows up here
+static void sof_irq_handler(void) {
+    uint16_t frame = (uint16_t)(usb_hw->sof_rd & USB_SOF_RD_BITS);
+    if (frame != sof_irq_frame) {
+        uint32_t slot         = frame & (SOF_STAMPS - 1);
+        sof_irq_frame         = frame;
+        sof_stamp_us[slot]    = time_us_32();
+        sof_stamp_frame[slot] = frame;
+    }
+}
 
-static PIO  pio = pio1;
-static uint sm_gen;
-
-uint32_t audio_frame_ticks;
+// Interrupt time of a SOF on the time_us_64() timeline, false if it is no
+// longer in the ring
+static bool sof_stamp(uint32_t frame_count, uint64_t *us) {
+    uint32_t slot      = frame_count & (SOF_STAMPS - 1);
+    uint32_t irq_state = save_and_disable_interrupts();
+    bool     found     = sof_stamp_frame[slot] == (frame_count & 0x7FF);
+    uint32_t stamp     = sof_stamp_us[slot];
+    uint64_t now       = time_us_64();
+    restore_interrupts(irq_state);
+
+    *us = now - (uint32_t)((uint32_t)now - stamp);
+    return found;
+}
 
 void setup_uart() {
     uart_init(UART_ID, BAUD_RATE);
@@ -61,83 +241,403 @@ void setup_uart() {
     stdio_uart_init();
 }
 
-void init_double_buffering(void) {
-    for (int i = 0; i < 2; i++) {
-        spk_buffers[i].size     = 0;
-        spk_buffers[i].position = 0;
-        spk_buffers[i].ready    = false;
+void spk_ring_reset(void) {
+    // The timer ISR must not see a half reset ring
+    uint32_t irq_state = save_and_disable_interrupts();
+    spk_ring_read      = 0;
+    spk_ring_write     = 0;
+    spk_ring_end       = SPK_RING_SIZE;
+    restore_interrupts(irq_state);
+}
+
+// Find `slots` contiguous free slots, NULL if the ring is too full.
+// The segment must stay strictly below the read index, otherwise a full ring
+// would look empty after the commit.
+static uint16_t *spk_ring_reserve(uint16_t slots, bool *wrapped) {
+    uint16_t r = spk_ring_read;
+    uint16_t w = spk_ring_write;
+
+    *wrapped = false;
+    if (w >= r) {
+        if (slots <= SPK_RING_SIZE - w) {
+            return &spk_ring[w];
+        }
+        if (slots < r) {
+            *wrapped = true;
+            return &spk_ring[0];
+        }
+        return NULL;
+    }
+    if (slots < r - w) {
+        return &spk_ring[w];
+    }
+    return NULL;
+}
+
+// Publish `count` codes written at the reserved segment
+static void spk_ring_commit(uint16_t *segment, uint16_t count, bool wrapped) {
+    if (wrapped) {
+        // The end marker has to be visible before the new write index
+        spk_ring_end = spk_ring_write;
     }
-    current_spk_write_buffer = 0;
-    current_spk_read_buffer  = 0;
+    spk_ring_write = (uint16_t)(segment - spk_ring) + count;
 }
 
 void generate_pulse(uint32_t pause_width) {
     pio_sm_put_blocking(pio, sm_gen, pause_width);
 }
 
-uint32_t calculate_audio_frame_ticks() {
-    return 1000000 / current_sample_rate;
+#if PPM_LANES > 1
+// The TX FIFOs of SMs 0..PPM_LANES-1 are consecutive registers, one transfer
+// with write increment puts a word into each a cycle apart. There is no DREQ,
+// the ISR paces the frames and each generator takes its word long before the
+// next one arrives.
+static void generate_frame(void) {
+    dma_channel_set_write_addr((uint)dma_gen, &pio->txf[sm_gen], false);
+    dma_channel_transfer_from_buffer_now((uint)dma_gen, lane_codes, PPM_LANES);
+}
+#endif
+
+// UAC2 volume (1/256 dB) to Q24 gain, linear interpolation between table entries
+static int32_t volume_to_gain_q24(int32_t vol) {
+    if (vol >= 0) {
+        return GAIN_UNITY_Q24;
+    }
+
+    uint32_t att = (uint32_t)-vol;
+    uint32_t idx = att >> 8;
+    if (idx >= TU_ARRAY_SIZE(db_to_gain_q15) - 1) {
+        return 0;
+    }
+
+    int32_t frac = (int32_t)(att & 0xFF);
+    int32_t g    = db_to_gain_q15[idx] - (((db_to_gain_q15[idx] - db_to_gain_q15[idx + 1]) * frac) >> 8);
+    return g << 9;
+}
+
+// Recompute channel gains after a mute/volume change, master channel 0 applies to all
+static void update_channel_gains(void) {
+    for (uint8_t ch = 0; ch < CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX; ch++) {
+        if (mute[0] || mute[ch + 1]) {
+            gain_target[ch] = 0;
+        }
+        else {
+            gain_target[ch] = volume_to_gain_q24(volume[0] + volume[ch + 1]);
+        }
+    }
+}
+
+static inline int32_t apply_gain(int32_t sample, int32_t *gain, int32_t target) {
+    *gain += (target - *gain) >> GAIN_SMOOTH_SHIFT;
+    return (sample * (*gain >> 9)) >> 15;
+}
+
+// Frame period (one symbol on every lane) for the current rate, corrected by
+// the SOF frequency estimate
+void update_symbol_period(void) {
+    uint32_t nominal = (uint32_t)(((uint64_t)1000000 * PPM_LANES << 16) / current_sample_rate);
+    symbol_period_q16 = nominal + (uint32_t)(((int64_t)nominal * sof_ppm_error_q8) / (1000000 * 256));
 }
 
 // Initialize PIO for pulse generator
 void init_pulse_generator(float freq) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-conversion"
+#if PPM_LANES > 1
+    // Fixed SM numbers, generate_frame walks their FIFOs in order
+    sm_gen      = 0;
+#else
     sm_gen      = pio_claim_unused_sm(pio, true);
+#endif
+#if DETECTOR_MODE == DETECTOR_DUAL
+    uint offset = pio_add_program(pio, &pulse_generator_fine_program);
+#pragma GCC diagnostic pop
+    pio_sm_config c = pulse_generator_fine_program_get_default_config(offset);
+#else
     uint offset = pio_add_program(pio, &pulse_generator_program);
 #pragma GCC diagnostic pop
     pio_sm_config c = pulse_generator_program_get_default_config(offset);
+#endif
 
+    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / freq);
+
+#if PPM_LANES > 1
+    static const uint gen_pins[] = LANE_GEN_PINS;
+    uint32_t          mask       = 0;
+
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    for (uint lane = 0; lane < PPM_LANES; lane++) {
+        pio_sm_claim(pio, sm_gen + lane);
+        // Side-set drives the same pin; left at its default base of GPIO 0
+        // every lane would drive lane 0's pin, and the highest SM wins it
+        sm_config_set_set_pins(&c, gen_pins[lane], 1);
+        sm_config_set_sideset_pins(&c, gen_pins[lane]);
+        pio_gpio_init(pio, gen_pins[lane]);
+        pio_sm_set_consecutive_pindirs(pio, sm_gen + lane, gen_pins[lane], 1, true);
+        pio_sm_init(pio, sm_gen + lane, offset, &c);
+        mask |= 1u << (sm_gen + lane);
+    }
+    // Same clock divider phase on every lane
+    pio_enable_sm_mask_in_sync(pio, mask);
+
+    dma_gen              = dma_claim_unused_channel(true);
+    dma_channel_config d = dma_channel_get_default_config((uint)dma_gen);
+    channel_config_set_transfer_data_size(&d, DMA_SIZE_32);
+    channel_config_set_read_increment(&d, true);
+    channel_config_set_write_increment(&d, true);
+    dma_channel_configure((uint)dma_gen, &d, &pio->txf[sm_gen], lane_codes, PPM_LANES, false);
+#else
     // Setup pins for PIO
     sm_config_set_set_pins(&c, PULSE_GEN_PIN, 1);
+    sm_config_set_sideset_pins(&c, PULSE_GEN_PIN);
     pio_gpio_init(pio, PULSE_GEN_PIN);
     pio_sm_set_consecutive_pindirs(pio, sm_gen, PULSE_GEN_PIN, 1, true);
 
-    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / freq);
-
     pio_sm_init(pio, sm_gen, offset, &c);
     pio_sm_set_enabled(pio, sm_gen, true);
+#endif
 }
 
+// Audio is scaled into the codes below the control band
 uint16_t audio_to_ppm(int16_t audio_sample) {
-    return (uint16_t)(((int64_t)audio_sample + 32768) * 1024 / 65536);
+    return (uint16_t)((((uint32_t)audio_sample + 32768) * ppm_audio_span(ppm_code_bits)) >> 16);
 }
 
 int16_t ppm_to_audio(uint32_t ppm_value) {
-    ppm_value &= 0x3FF;
-    return (int16_t)(((int64_t)ppm_value * 65536 / 1024) - 32768);
+    uint32_t span = ppm_audio_span(ppm_code_bits);
+    if (ppm_value >= span) {
+        ppm_value = span - 1;
+    }
+    return (int16_t)((int32_t)((ppm_value << 16) / span) - 32768);
+}
+
+// Print which sample rates fit the PPM frame at each supported SYS_FREQ
+void report_ppm_budget(void) {
+    static const uint32_t sys_freqs[] = {133000, 250000};
+
+    for (uint8_t f = 0; f < TU_ARRAY_SIZE(sys_freqs); f++) {
+        printf("PPM budget at %lu kHz%s:\r\n", sys_freqs[f], sys_freqs[f] == SYS_FREQ ? " (active)" : "");
+        for (uint8_t i = 0; i < N_SAMPLE_RATES; i++) {
+            uint8_t bits = ppm_code_bits_for(sys_freqs[f], sample_rates[i]);
+            if (bits) {
+                printf("  %6lu Hz: %u bit codes, frame %lu of %lu cycles\r\n",
+                       sample_rates[i],
+                       bits,
+                       ppm_frame_cycles(sys_freqs[f], bits),
+                       sys_freqs[f] * 1000 * PPM_LANES / sample_rates[i]);
+            }
+            else {
+                printf("  %6lu Hz: not feasible\r\n", sample_rates[i]);
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------+
+// Format conversion kernels
+//--------------------------------------------------------------------+
+
+// 16 bit in 16 bit slots
+static uint16_t spk_convert_16(const void *src_buf, uint16_t n_bytes, uint16_t *dst) {
+    const int16_t *src          = (const int16_t *)src_buf;
+    const int16_t *limit        = src + (n_bytes / 4) * 2;
+    uint16_t       count        = 0;
+    int32_t        target_left  = gain_target[0];
+    int32_t        target_right = gain_target[1];
+
+    // Gain is applied in the same pass as the PPM conversion
+    while (src < limit) {
+        int32_t left  = apply_gain(*src++, &gain_current[0], target_left);
+        int32_t right = apply_gain(*src++, &gain_current[1], target_right);
+        int16_t mixed = (int16_t)((left >> 1) + (right >> 1));
+        dst[count++]  = audio_to_ppm(mixed);
+    }
+    return count;
 }
+
+// 24 bit, MSB aligned in 32 bit slots.
+// Only the upper half of each slot is used, so the samples are read as 16 bit
+// words: the ring only guarantees 2 byte alignment.
+static uint16_t spk_convert_24(const void *src_buf, uint16_t n_bytes, uint16_t *dst) {
+    const int16_t *src          = (const int16_t *)src_buf;
+    const int16_t *limit        = src + (n_bytes / 8) * 4;
+    uint16_t       count        = 0;
+    int32_t        target_left  = gain_target[0];
+    int32_t        target_right = gain_target[1];
+
+    while (src < limit) {
+        int32_t left  = apply_gain(src[1], &gain_current[0], target_left);
+        int32_t right = apply_gain(src[3], &gain_current[1], target_right);
+        int16_t mixed = (int16_t)((left >> 1) + (right >> 1));
+        src += 4;
+        dst[count++] = audio_to_ppm(mixed);
+    }
+    return count;
+}
+
+// 8 bit in 8 bit slots
+static uint16_t spk_convert_8(const void *src_buf, uint16_t n_bytes, uint16_t *dst) {
+    const int8_t *src          = (const int8_t *)src_buf;
+    const int8_t *limit        = src + (n_bytes / 2) * 2;
+    uint16_t      count        = 0;
+    int32_t       target_left  = gain_target[0];
+    int32_t       target_right = gain_target[1];
+
+    while (src < limit) {
+        int32_t left  = apply_gain(*src++ * 256, &gain_current[0], target_left);
+        int32_t right = apply_gain(*src++ * 256, &gain_current[1], target_right);
+        int16_t mixed = (int16_t)((left >> 1) + (right >> 1));
+        dst[count++]  = audio_to_ppm(mixed);
+    }
+    return count;
+}
+
+static uint16_t mic_convert_16(const uint32_t *ppm, uint16_t count, void *dst_buf) {
+    int16_t *dst = (int16_t *)dst_buf;
+    for (uint16_t i = 0; i < count; i++) {
+        dst[i] = ppm_to_audio(ppm[i]);
+    }
+    return (uint16_t)(count * 2);
+}
+
+static uint16_t mic_convert_24(const uint32_t *ppm, uint16_t count, void *dst_buf) {
+    int32_t *dst = (int32_t *)dst_buf;
+    for (uint16_t i = 0; i < count; i++) {
+        dst[i] = (int32_t)ppm_to_audio(ppm[i]) * 65536;
+    }
+    return (uint16_t)(count * 4);
+}
+
+static uint16_t mic_convert_8(const uint32_t *ppm, uint16_t count, void *dst_buf) {
+    int8_t *dst = (int8_t *)dst_buf;
+    for (uint16_t i = 0; i < count; i++) {
+        dst[i] = (int8_t)(ppm_to_audio(ppm[i]) >> 8);
+    }
+    return count;
+}
+
+static spk_kernel_t spk_kernel_for(uint8_t resolution) {
+    switch (resolution) {
+        case 8:
+            return spk_convert_8;
+        case 16:
+            return spk_convert_16;
+        case 24:
+            return spk_convert_24;
+        default:
+            return NULL;
+    }
+}
+
+static mic_kernel_t mic_kernel_for(uint8_t resolution) {
+    switch (resolution) {
+        case 8:
+            return mic_convert_8;
+        case 16:
+            return mic_convert_16;
+        case 24:
+            return mic_convert_24;
+        default:
+            return NULL;
+    }
+}
+
 void timer0_irq_handler() {
     if (timer_hw->intr & (1u << 0)) {
         timer_hw->intr = 1u << 0;
+        LATENCY_BEGIN(isr_start);
+        LATENCY_RECORD(LAT_TX_ISR_ENTRY, (timer_hw->timerawl - symbol_alarm_at) * (SYS_FREQ / 1000));
+        TRACE_BEGIN(TRACE_TX_ISR);
+
+        uint8_t  bits    = ppm_code_bits;
+        uint16_t r       = spk_ring_read;
+        uint16_t w       = spk_ring_write;
+        uint8_t  samples = 0;    // Lanes whose slot holds a sample
+        bool     marker  = false;
+
+        // One slot per lane, consecutive samples in lane order
+        for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+            // Writer has wrapped and everything up to its end marker is sent
+            if (r != w && w < r && r == spk_ring_end) {
+                r = 0;
+            }
 
-        uint32_t ppm_value;
+            lane_codes[lane] = 0;
+            if (r == w) {
+                if (spk_streaming) {
+                    spk_underruns++;
+                }
+                continue;
+            }
+            // Control symbols take the slot of the sample due now, the receiver conceals it
+            if (marker_state == MARKER_QUEUED && r == marker_ring_pos) {
+                lane_codes[lane] = ppm_marker_code(bits);
+                marker_tx_us     = timer_hw->timerawl;
+                marker_state     = MARKER_SENT;
+                marker           = true;
+            }
+            else {
+                lane_codes[lane]  = spk_ring[r];
+                samples          |= 1u << lane;
+            }
+            r++;
+        }
+        spk_ring_read = r;
+
+        // Pilots go out on every lane of a frame, the receiver aligns the
+        // lanes and measures the link on them. A due pilot waits for a frame
+        // without audio, so the receiver does not hold a sample in its place,
+        // unless pilot_in_audio is set. Lanes are only realigned at pilots,
+        // so that is the default with more than one. While audio never
+        // pauses a pilot still replaces a sample every
+        // PPM_PILOT_AUDIO_INTERVAL frames to keep the estimate alive. The
+        // marker delays it as well.
+        if (pilot_count < PPM_PILOT_AUDIO_INTERVAL) {
+            pilot_count++;
+        }
+        bool pilot = pilot_count >= PPM_PILOT_INTERVAL && !marker &&
+                     (pilot_in_audio || !samples || pilot_count >= PPM_PILOT_AUDIO_INTERVAL);
+        if (pilot) {
+            pilot_count = 0;
+        }
 
-        if (spk_buffers[current_spk_read_buffer].ready &&
-            spk_buffers[current_spk_read_buffer].position < spk_buffers[current_spk_read_buffer].size) {
+        for (uint8_t lane = 0; lane < PPM_LANES; lane++) {
+            core0_stats.total_sent++;
+            if (pilot) {
+                lane_codes[lane] = ppm_pilot_code(bits);
+            }
+            else if (samples & (1u << lane)) {
+                core0_stats.total_ppm_sent++;
+                core0_stats.total_summed_ppm_out += lane_codes[lane];
+            }
+            lane_codes[lane] += MIN_INTERVAL_CYCLES;
+        }
 
-            ppm_value = MIN_INTERVAL_CYCLES +
-                        spk_buffers[current_spk_read_buffer].ppm_buffer[spk_buffers[current_spk_read_buffer].position++];
+#if PPM_LANES > 1
+        generate_frame();
+#else
+        generate_pulse(lane_codes[0]);
+#endif
 
-            if (spk_buffers[current_spk_read_buffer].position >= spk_buffers[current_spk_read_buffer].size) {
-                spk_buffers[current_spk_read_buffer].ready    = false;
-                spk_buffers[current_spk_read_buffer].position = 0;
-                spk_buffers[current_spk_read_buffer].size     = 0;
+        uint32_t phase   = symbol_phase_q16 + symbol_period_q16;
+        symbol_alarm_at += phase >> 16;
+        symbol_phase_q16 = phase & 0xFFFF;
 
-                current_spk_read_buffer = (uint8_t)((current_spk_read_buffer + 1) % 2);
-            }
-        }
-        else {
-            ppm_value = MIN_INTERVAL_CYCLES;
+        // An alarm in the past would only fire after the timer wraps
+        if ((int32_t)(symbol_alarm_at - timer_hw->timerawl) <= 0) {
+            symbol_alarm_at = timer_hw->timerawl + 1;
+            pacing_slips++;
         }
+        timer_hw->alarm[0] = symbol_alarm_at;
 
-        generate_pulse(ppm_value);
-        timer_hw->alarm[0] = timer_hw->timerawl + audio_frame_ticks;
+        TRACE_END(TRACE_TX_ISR, lane_codes[0] - MIN_INTERVAL_CYCLES);
+        LATENCY_END(LAT_TX_ISR, isr_start);
     }
 }
 
 void first_core_main() {
     board_init();
+    latency_init();
     setup_uart();
 
     tusb_rhport_init_t dev_init = {
@@ -152,24 +652,35 @@ void first_core_main() {
     TU_LOG1("Laser Audio running\r\n");
     stdio_init_all();
 
-    init_double_buffering();
+    update_channel_gains();
+    for (uint8_t ch = 0; ch < CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX; ch++) {
+        gain_current[ch] = gain_target[ch];
+    }
+
+    spk_ring_reset();
 
     init_pulse_generator(PIO_FREQ);
 
-    audio_frame_ticks = 1000000 / AUDIO_SAMPLE_RATE;
+    report_ppm_budget();
+    ppm_code_bits     = ppm_code_bits_for(SYS_FREQ, current_sample_rate);
+    update_symbol_period();
+    tud_sof_cb_enable(true);
+    irq_add_shared_handler(USBCTRL_IRQ, sof_irq_handler, PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY);
 
     // Setup timer interrupt for audio sampling
     irq_set_exclusive_handler(TIMER_IRQ_0, timer0_irq_handler);
     hw_set_bits(&timer_hw->inte, (1u << 0));
     irq_set_enabled(TIMER_IRQ_0, true);
 
-    timer_hw->alarm[0] = timer_hw->timerawl + audio_frame_ticks;
+    symbol_alarm_at    = timer_hw->timerawl + (symbol_period_q16 >> 16);
+    timer_hw->alarm[0] = symbol_alarm_at;
 
     // Main operation loop on Core1
     while (1) {
         tud_task();
-        spk_task();
         mic_task();
+        telemetry_task();
+        signal_status_task();
         led_blinking_task();
     }
 }
@@ -186,6 +697,7 @@ void tud_mount_cb(void) {
 // Invoked when device is unmounted
 void tud_umount_cb(void) {
     blink_interval_ms = BLINK_NOT_MOUNTED;
+    sof_locked        = false;
 }
 
 // Invoked when usb bus is suspended
@@ -194,6 +706,7 @@ void tud_umount_cb(void) {
 void tud_suspend_cb(bool remote_wakeup_en) {
     (void)remote_wakeup_en;
     blink_interval_ms = BLINK_SUSPENDED;
+    sof_locked        = false;
 }
 
 // Invoked when usb bus is resumed
@@ -201,6 +714,316 @@ void tud_resume_cb(void) {
     blink_interval_ms = tud_mounted() ? BLINK_MOUNTED : BLINK_NOT_MOUNTED;
 }
 
+// Lock the symbol clock to the host.
+// frame_count is the 11 bit frame number, so frames the stack coalesced or
+// that were handled late are still counted.
+static void sof_discipline(uint32_t frame_count) {
+    uint64_t stamp_us;
+    if (!sof_stamp(frame_count, &stamp_us)) {
+        // Handled too late, the next frame carries on
+        return;
+    }
+    int64_t now_q16 = (int64_t)stamp_us << 16;
+
+    if (!sof_locked) {
+        sof_predicted_q16 = now_q16;
+        sof_last_frame    = frame_count;
+        sof_locked        = true;
+        return;
+    }
+
+    uint32_t frames = (frame_count - sof_last_frame) & 0x7FF;
+    sof_last_frame  = frame_count;
+    if (frames == 0) {
+        return;
+    }
+    if (frames > SOF_MAX_GAP) {
+        sof_locked = false;
+        sof_relocks++;
+        return;
+    }
+
+    // Model frame length in timer microseconds, Q16
+    int64_t frame_q16 = ((int64_t)1000 << 16) + ((int64_t)sof_ppm_error_q8 * 256) / 1000;
+    sof_predicted_q16 += frame_q16 * frames;
+
+    int64_t error_q16 = now_q16 - sof_predicted_q16;
+    if (error_q16 > ((int64_t)SOF_RELOCK_US << 16) || error_q16 < -((int64_t)SOF_RELOCK_US << 16)) {
+        sof_locked = false;
+        sof_relocks++;
+        return;
+    }
+
+    sof_predicted_q16 += error_q16 >> SOF_KP_SHIFT;
+
+    int32_t ppm = sof_ppm_error_q8 + (int32_t)(error_q16 >> SOF_KI_SHIFT);
+    if (ppm > SOF_PPM_LIMIT) {
+        ppm = SOF_PPM_LIMIT;
+    }
+    else if (ppm < -SOF_PPM_LIMIT) {
+        ppm = -SOF_PPM_LIMIT;
+    }
+    sof_ppm_error_q8 = ppm;
+
+    update_symbol_period();
+}
+
+static void jitter_buffer_reset(void) {
+    jb_head     = 0;
+    jb_tail     = 0;
+    jb_rate_acc = 0;
+    jb_state    = JB_PRIMING;
+
+    jb_stats.depth_min = UINT16_MAX;
+    jb_stats.depth_max = 0;
+}
+
+void jitter_buffer_configure(const jitter_config_t *config) {
+    jb_config = *config;
+    if (jb_config.target_depth > JB_SIZE / 2) {
+        jb_config.target_depth = JB_SIZE / 2;
+    }
+}
+
+void jitter_buffer_get_config(jitter_config_t *config) {
+    *config = jb_config;
+}
+
+void jitter_buffer_get_stats(jitter_stats_t *stats, bool reset_min_max) {
+    *stats = jb_stats;
+    if (reset_min_max) {
+        jb_stats.depth_min = jb_stats.depth;
+        jb_stats.depth_max = jb_stats.depth;
+    }
+}
+
+// Target depth in samples, never below one USB frame
+static uint16_t jitter_buffer_target(void) {
+    uint16_t frame = (uint16_t)((current_sample_rate + 999) / 1000);
+    if (jb_config.low_latency || jb_config.target_depth < frame) {
+        return frame;
+    }
+    return jb_config.target_depth;
+}
+
+// Arm a marker every marker_interval_ms and give up on one that is lost
+static void marker_task(void) {
+    uint32_t now = board_millis();
+
+    if (marker_state == MARKER_IDLE) {
+        if (marker_interval_ms && spk_streaming && mic_streaming && now - marker_armed_ms >= marker_interval_ms) {
+            marker_armed_ms = now;
+            marker_state    = MARKER_ARMED;
+        }
+    }
+    else if (now - marker_armed_ms >= MARKER_TIMEOUT_MS) {
+        markers_lost++;
+        marker_state = MARKER_IDLE;
+    }
+}
+
+static uint32_t marker_bucket(uint32_t us) {
+    if (us < MARKER_HIST_SUB) {
+        return us;
+    }
+    uint32_t shift  = 31 - (uint32_t)__builtin_clz(us) - MARKER_HIST_SUB_BITS;
+    uint32_t bucket = (shift + 1) * MARKER_HIST_SUB + (us >> shift) - MARKER_HIST_SUB;
+    return bucket < MARKER_HIST_BUCKETS ? bucket : MARKER_HIST_BUCKETS - 1;
+}
+
+// Smallest value of a bucket
+static uint32_t marker_bucket_floor(uint32_t bucket) {
+    if (bucket < MARKER_HIST_SUB) {
+        return bucket;
+    }
+    return (MARKER_HIST_SUB + bucket % MARKER_HIST_SUB) << (bucket / MARKER_HIST_SUB - 1);
+}
+
+static void marker_hist_add(marker_hist_t *hist, uint32_t us) {
+    if (!hist->count || us < hist->min_us) {
+        hist->min_us = us;
+    }
+    if (us > hist->max_us) {
+        hist->max_us = us;
+    }
+    hist->count++;
+    hist->buckets[marker_bucket(us)]++;
+}
+
+// Upper edge of the bucket holding the given percentile, at most the maximum
+static uint32_t marker_hist_percentile(const marker_hist_t *hist, uint32_t percent) {
+    uint32_t target = (hist->count * percent + 99) / 100;
+    uint32_t seen   = 0;
+
+    for (uint32_t bucket = 0; bucket < MARKER_HIST_BUCKETS - 1; bucket++) {
+        seen += hist->buckets[bucket];
+        if (seen >= target) {
+            uint32_t top = marker_bucket_floor(bucket + 1) - 1;
+            return top < hist->max_us ? top : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+// The tagged sample reached a USB IN packet
+static void marker_complete(void) {
+    if (marker_state != MARKER_SENT) {
+        return;
+    }
+
+    uint32_t now      = time_us_32();
+    uint32_t stages[] = {
+        marker_tx_us - marker_usb_out_us,
+        marker_rx_us - marker_tx_us,
+        marker_fifo_us - marker_rx_us,
+        now - marker_fifo_us,
+        now - marker_usb_out_us,
+    };
+
+    for (uint32_t i = 0; i < TU_ARRAY_SIZE(stages); i++) {
+        marker_hist_add(&marker_hists[i], stages[i]);
+        LATENCY_RECORD((latency_region_t)(LAT_E2E_QUEUE + i), stages[i] * (SYS_FREQ / 1000));
+    }
+    markers_received++;
+    marker_state = MARKER_IDLE;
+}
+
+// Store one code from core 1, applying the overrun policy when full
+static void jitter_buffer_push(uint32_t value) {
+    if ((uint16_t)(jb_head - jb_tail) >= JB_SIZE) {
+        jb_stats.overruns++;
+        switch (jb_config.overrun) {
+            case JB_OVERRUN_DROP_NEWEST:
+                return;
+            case JB_OVERRUN_RESYNC:
+                jb_tail = (uint16_t)(jb_head - jitter_buffer_target());
+                break;
+            default:
+                jb_tail++;
+                break;
+        }
+    }
+    jb_queue[jb_head++ & (JB_SIZE - 1)] = value;
+}
+
+// Cut one IN packet. Its size is the number of samples due in this frame
+// (44/44/.../45 at 44.1 kHz), trimmed by one when the depth drifts away from
+// the target, so latency stays where it was configured and the host sees a
+// steady isochronous cadence.
+static void mic_send_frame(void) {
+    static uint32_t ppm_values[CFG_TUD_AUDIO_FUNC_1_MAX_SAMPLE_RATE / 1000 + 1];
+    static uint32_t last_value;
+
+    if (!mic_streaming || !mic_kernel) {
+        return;
+    }
+
+    LATENCY_BEGIN(frame_start);
+    TRACE_BEGIN(TRACE_MIC_FRAME);
+
+    // Pick up what core 1 produced since the last frame
+    mic_task();
+
+    // Beam lost: silence until it is back, then prime from fresh samples
+    if (signal_lost) {
+        jb_tail  = jb_head;
+        jb_state = JB_PRIMING;
+    }
+
+    jb_rate_acc     += current_sample_rate;
+    uint16_t due     = (uint16_t)(jb_rate_acc / 1000);
+    jb_rate_acc     %= 1000;
+    uint16_t max     = (uint16_t)(current_sample_rate / 1000 + 1);
+    uint16_t target  = jitter_buffer_target();
+    uint16_t depth   = (uint16_t)(jb_head - jb_tail);
+    uint32_t silence = ppm_audio_span(ppm_code_bits) / 2;
+    uint16_t samples = due;
+
+    jb_stats.depth  = depth;
+    jb_stats.target = target;
+    if (depth < jb_stats.depth_min) {
+        jb_stats.depth_min = depth;
+    }
+    if (depth > jb_stats.depth_max) {
+        jb_stats.depth_max = depth;
+    }
+
+    if (jb_state == JB_PRIMING) {
+        if (depth >= target) {
+            jb_state = JB_PLAYING;
+        }
+    }
+    else {
+        int32_t error = (int32_t)depth - (int32_t)target;
+
+        if (error > JB_TRIM_HYST && samples < max) {
+            samples++;
+        }
+        else if (error < -JB_TRIM_HYST && samples > 0) {
+            samples--;
+        }
+
+        // Far above target: drop back instead of trimming one sample per frame
+        if (jb_config.overrun == JB_OVERRUN_RESYNC && error > (int32_t)target) {
+            jb_tail = (uint16_t)(jb_head - target);
+            depth   = target;
+            jb_stats.overruns++;
+        }
+
+        if (depth < samples) {
+            jb_stats.underruns++;
+            jb_state = JB_UNDERRUN;
+        }
+        else {
+            jb_state = JB_PLAYING;
+        }
+    }
+
+    bool pad_silence = jb_state == JB_PRIMING ||
+                       (jb_state == JB_UNDERRUN && jb_config.underrun != JB_UNDERRUN_REPEAT);
+
+    uint32_t summed = 0;
+    for (uint16_t i = 0; i < samples; i++) {
+        if (jb_state != JB_PRIMING && jb_head != jb_tail) {
+            last_value = jb_queue[jb_tail++ & (JB_SIZE - 1)];
+            if (last_value & PPM_MARKER_FLAG) {
+                last_value &= ~PPM_MARKER_FLAG;
+                marker_complete();
+            }
+        }
+        else if (pad_silence) {
+            last_value = silence;
+        }
+        ppm_values[i] = last_value;
+        summed       += last_value;
+    }
+
+    jb_stats.state = jb_state;
+    jb_stats.frames_in_state[jb_state]++;
+    if (jb_state == JB_UNDERRUN && jb_config.underrun == JB_UNDERRUN_REBUFFER) {
+        jb_state = JB_PRIMING;
+    }
+
+    uint16_t n_bytes = mic_kernel(ppm_values, samples, mic_buf);
+    uint16_t written = tud_audio_write((uint8_t *)mic_buf, n_bytes);
+
+    core0_stats.total_pcm_convert += samples;
+    core0_stats.total_summed_ppm_in_usb += summed;
+    core0_stats.total_ticks_attempt_send_to_usb++;
+    core0_stats.total_bytes_sent_to_usb += written;
+
+    TRACE_END(TRACE_MIC_FRAME, samples);
+    LATENCY_END(LAT_MIC_FRAME, frame_start);
+}
+
+// Invoked every USB frame (1 ms) once enabled with tud_sof_cb_enable()
+void tud_sof_cb(uint32_t frame_count) {
+    TRACE_MARK(TRACE_SOF, frame_count);
+    sof_discipline(frame_count);
+    mic_send_frame();
+    marker_task();
+}
+
 // Helper for clock get requests
 static bool tud_audio_clock_get_request(uint8_t rhport, audio_control_request_t const *request) {
     TU_ASSERT(request->bEntityID == UAC2_ENTITY_CLOCK);
@@ -213,18 +1036,23 @@ static bool tud_audio_clock_get_request(uint8_t rhport, audio_control_request_t
             return tud_audio_buffer_and_schedule_control_xfer(rhport, (tusb_control_request_t const *)request, &curf, sizeof(curf));
         }
         else if (request->bRequest == AUDIO_CS_REQ_RANGE) {
-            audio_control_range_4_n_t(N_SAMPLE_RATES) rangef =
-                {
-                    .wNumSubRanges = tu_htole16(N_SAMPLE_RATES)};
-            TU_LOG1("Clock get %d freq ranges\r\n", N_SAMPLE_RATES);
+            audio_control_range_4_n_t(N_SAMPLE_RATES) rangef;
+            uint16_t n_ranges = 0;
+
+            // Only advertise rates whose PPM frame fits at this SYS_FREQ
             for (uint8_t i = 0; i < N_SAMPLE_RATES; i++) {
-                rangef.subrange[i].bMin = (int32_t)sample_rates[i];
-                rangef.subrange[i].bMax = (int32_t)sample_rates[i];
-                rangef.subrange[i].bRes = 0;
-                TU_LOG1("Range %d (%d, %d, %d)\r\n", i, (int)rangef.subrange[i].bMin, (int)rangef.subrange[i].bMax, (int)rangef.subrange[i].bRes);
+                if (!ppm_code_bits_for(SYS_FREQ, sample_rates[i]))
+                    continue;
+                rangef.subrange[n_ranges].bMin = (int32_t)sample_rates[i];
+                rangef.subrange[n_ranges].bMax = (int32_t)sample_rates[i];
+                rangef.subrange[n_ranges].bRes = 0;
+                TU_LOG1("Range %d (%d, %d, %d)\r\n", n_ranges, (int)rangef.subrange[n_ranges].bMin, (int)rangef.subrange[n_ranges].bMax, (int)rangef.subrange[n_ranges].bRes);
+                n_ranges++;
             }
+            rangef.wNumSubRanges = tu_htole16(n_ranges);
+            TU_LOG1("Clock get %d freq ranges\r\n", n_ranges);
 
-            return tud_audio_buffer_and_schedule_control_xfer(rhport, (tusb_control_request_t const *)request, &rangef, sizeof(rangef));
+            return tud_audio_buffer_and_schedule_control_xfer(rhport, (tusb_control_request_t const *)request, &rangef, (uint16_t)(sizeof(rangef.wNumSubRanges) + n_ranges * sizeof(rangef.subrange[0])));
         }
     }
     else if (request->bControlSelector == AUDIO_CS_CTRL_CLK_VALID &&
@@ -250,10 +1078,15 @@ static bool tud_audio_clock_set_request(uint8_t rhport, audio_control_request_t
     if (request->bControlSelector == AUDIO_CS_CTRL_SAM_FREQ) {
         TU_VERIFY(request->wLength == sizeof(audio_control_cur_4_t));
 
-        current_sample_rate = (uint32_t)((audio_control_cur_4_t const *)buf)->bCur;
-        audio_frame_ticks   = calculate_audio_frame_ticks();
+        uint32_t rate = (uint32_t)((audio_control_cur_4_t const *)buf)->bCur;
+        uint8_t  bits = ppm_code_bits_for(SYS_FREQ, rate);
+        TU_VERIFY(bits != 0);
 
-        TU_LOG1("Clock set current freq: %" PRIu32 "\r\n", current_sample_rate);
+        current_sample_rate = rate;
+        ppm_code_bits       = bits;
+        update_symbol_period();
+
+        TU_LOG1("Clock set current freq: %" PRIu32 ", %u bit codes\r\n", current_sample_rate, ppm_code_bits);
 
         return true;
     }
@@ -308,6 +1141,7 @@ static bool tud_audio_feature_unit_set_request(uint8_t rhport, audio_control_req
         TU_VERIFY(request->wLength == sizeof(audio_control_cur_1_t));
 
         mute[request->bChannelNumber] = ((audio_control_cur_1_t const *)buf)->bCur;
+        update_channel_gains();
 
         TU_LOG1("Set channel %d Mute: %d\r\n", request->bChannelNumber, mute[request->bChannelNumber]);
 
@@ -317,6 +1151,7 @@ static bool tud_audio_feature_unit_set_request(uint8_t rhport, audio_control_req
         TU_VERIFY(request->wLength == sizeof(audio_control_cur_2_t));
 
         volume[request->bChannelNumber] = ((audio_control_cur_2_t const *)buf)->bCur;
+        update_channel_gains();
 
         TU_LOG1("Set channel %d volume: %d dB\r\n", request->bChannelNumber, volume[request->bChannelNumber] / 256);
 
@@ -331,6 +1166,48 @@ static bool tud_audio_feature_unit_set_request(uint8_t rhport, audio_control_req
     }
 }
 
+// Helper for mic input terminal get requests. The beam is reported as the
+// connector: no channels while it is lost.
+static bool tud_audio_mic_terminal_get_request(uint8_t rhport, audio_control_request_t const *request) {
+    TU_ASSERT(request->bEntityID == UAC2_ENTITY_MIC_INPUT_TERMINAL);
+
+    if (request->bControlSelector == AUDIO_TE_CTRL_CONNECTOR && request->bRequest == AUDIO_CS_REQ_CUR) {
+        audio_desc_channel_cluster_t cluster = {
+            .bNrChannels     = signal_lost ? 0 : CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_TX,
+            .bmChannelConfig = AUDIO_CHANNEL_CONFIG_NON_PREDEFINED,
+            .iChannelNames   = 0};
+        return tud_audio_buffer_and_schedule_control_xfer(rhport, (tusb_control_request_t const *)request, &cluster, sizeof(cluster));
+    }
+    TU_LOG1("Mic terminal get request not supported, entity = %u, selector = %u, request = %u\r\n",
+            request->bEntityID,
+            request->bControlSelector,
+            request->bRequest);
+
+    return false;
+}
+
+// Tell the host when the beam is lost or back. It answers the interrupt by
+// reading the connector control of the mic input terminal.
+void signal_status_task(void) {
+    static bool reported = false;
+    bool        lost     = signal_lost;
+
+    if (lost == reported || !tud_audio_mounted()) {
+        return;
+    }
+
+    audio_interrupt_data_t data = {
+        .bInfo      = 0,    // Class specific, from an interface
+        .bAttribute = AUDIO_CS_REQ_CUR};
+    data.wValue_cn_or_mcn = 0;
+    data.wValue_cs        = AUDIO_TE_CTRL_CONNECTOR;
+    data.wIndex_ep_or_int = ITF_NUM_AUDIO_CONTROL;
+    data.wIndex_entity_id = UAC2_ENTITY_MIC_INPUT_TERMINAL;
+    if (tud_audio_int_write(&data)) {
+        reported = lost;
+    }
+}
+
 //--------------------------------------------------------------------+
 // Application Callback API Implementations
 //--------------------------------------------------------------------+
@@ -343,6 +1220,8 @@ bool tud_audio_get_req_entity_cb(uint8_t rhport, tusb_control_request_t const *p
         return tud_audio_clock_get_request(rhport, request);
     if (request->bEntityID == UAC2_ENTITY_SPK_FEATURE_UNIT)
         return tud_audio_feature_unit_get_request(rhport, request);
+    if (request->bEntityID == UAC2_ENTITY_MIC_INPUT_TERMINAL)
+        return tud_audio_mic_terminal_get_request(rhport, request);
     else {
         TU_LOG1("Get request not handled, entity = %d, selector = %d, request = %d\r\n",
                 request->bEntityID,
@@ -374,8 +1253,10 @@ bool tud_audio_set_itf_close_EP_cb(uint8_t rhport, tusb_control_request_t const
     uint8_t const itf = tu_u16_low(tu_le16toh(p_request->wIndex));
     uint8_t const alt = tu_u16_low(tu_le16toh(p_request->wValue));
 
-    if (ITF_NUM_AUDIO_STREAMING_SPK == itf && alt == 0)
+    if (ITF_NUM_AUDIO_STREAMING_SPK == itf && alt == 0) {
         blink_interval_ms = BLINK_MOUNTED;
+        spk_streaming     = false;
+    }
 
     return true;
 }
@@ -389,10 +1270,24 @@ bool tud_audio_set_itf_cb(uint8_t rhport, tusb_control_request_t const *p_reques
     if (ITF_NUM_AUDIO_STREAMING_SPK == itf && alt != 0)
         blink_interval_ms = BLINK_STREAMING;
 
-    // Clear buffer when streaming format is changed
-    spk_data_size = 0;
-    if (alt != 0) {
-        current_resolution = resolutions_per_format[alt - 1];
+    // Clear buffer and pick the conversion kernel when streaming format is changed
+    if (ITF_NUM_AUDIO_STREAMING_SPK == itf) {
+        spk_streaming = false;
+        spk_ring_reset();
+        if (alt != 0) {
+            current_resolution = resolutions_per_format[alt - 1];
+            spk_kernel         = spk_kernel_for(current_resolution);
+            spk_streaming      = true;
+        }
+    }
+    else if (ITF_NUM_AUDIO_STREAMING_MIC == itf) {
+        jitter_buffer_reset();
+        mic_streaming = false;
+        if (alt != 0) {
+            mic_resolution = mic_resolutions_per_format[alt - 1];
+            mic_kernel     = mic_kernel_for(mic_resolution);
+            mic_streaming  = true;
+        }
     }
 
     return true;
@@ -404,16 +1299,46 @@ bool tud_audio_rx_done_pre_read_cb(uint8_t rhport, uint16_t n_bytes_received, ui
     (void)ep_out;
     (void)cur_alt_setting;
 
-    if (!spk_buffers[current_spk_write_buffer].ready) {
-        spk_data_size = tud_audio_read(spk_buf, n_bytes_received);
-        TU_LOG1("RX done pre read callback called, received %d bytes\r\n", spk_data_size);
-        if (sem_initialized) {
-            shared_ppm_data.packet_size = spk_data_size;
+    bool      wrapped;
+    uint16_t *segment = spk_kernel ? spk_ring_reserve((uint16_t)((n_bytes_received + 1) / 2), &wrapped) : NULL;
+
+    if (current_resolution) {
+        uint16_t frame_bytes = (current_resolution == 24 ? 4 : current_resolution / 8) * 2;
+        core0_stats.total_pcm_received += n_bytes_received / frame_bytes;
+    }
+
+    // Drop the packet but keep the endpoint running, returning false would stall it
+    if (!segment) {
+        if (spk_kernel) {
+            spk_overruns++;
         }
+        spk_lost_packets++;
+        tud_audio_clear_ep_out_ff();
         return true;
     }
-    TU_LOG1("RX done pre read callback called, but buffer is not ready\r\n");
-    return false;
+
+    LATENCY_BEGIN(convert_start);
+    TRACE_BEGIN(TRACE_SPK_RX);
+    uint16_t n_bytes = tud_audio_read(segment, n_bytes_received);
+    uint16_t count   = spk_kernel(segment, n_bytes, segment);
+    core0_stats.total_ppm_convert += count;
+    if (count) {
+        spk_ring_commit(segment, count, wrapped);
+
+        // Position first, the ISR looks at it once the state says queued
+        if (marker_state == MARKER_ARMED) {
+            marker_ring_pos   = (uint16_t)(segment - spk_ring);
+            marker_usb_out_us = time_us_32();
+            marker_state      = MARKER_QUEUED;
+            markers_sent++;
+        }
+    }
+    TRACE_END(TRACE_SPK_RX, count);
+    LATENCY_END(LAT_SPK_CONVERT, convert_start);
+    if (sem_initialized) {
+        shared_ppm_data.packet_size = n_bytes;
+    }
+    return true;
 }
 
 bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, uint8_t cur_alt_setting) {
@@ -425,62 +1350,313 @@ bool tud_audio_tx_done_pre_load_cb(uint8_t rhport, uint8_t itf, uint8_t ep_in, u
     return true;
 }
 
-void spk_task(void) {
-    if (spk_data_size && !spk_buffers[current_spk_write_buffer].ready) {
-        if (current_resolution == 16) {
-            int16_t  *src        = (int16_t *)spk_buf;
-            int16_t  *limit      = (int16_t *)spk_buf + spk_data_size / 2;
-            uint16_t *dst        = spk_buffers[current_spk_write_buffer].ppm_buffer;
-            uint16_t  buffer_pos = 0;
+// Drain the inter-core FIFO, it is only 8 words deep
+void mic_task(void) {
+    uint16_t drained = 0;
+
+    while (multicore_fifo_rvalid()) {
+        uint32_t value = multicore_fifo_pop_blocking();
 
-            while (src < limit) {
-                int32_t left      = *src++;
-                int32_t right     = *src++;
-                int16_t mixed     = (int16_t)((left >> 1) + (right >> 1));
-                dst[buffer_pos++] = audio_to_ppm(mixed);
-            }
+        if (value & PPM_MARKER_FLAG) {
+            marker_fifo_us = time_us_32();
+        }
+        if (mic_streaming) {
+            jitter_buffer_push(value);
+        }
+        drained++;
+    }
+    if (drained) {
+        TRACE_MARK(TRACE_MIC_TASK, drained);
+    }
+}
+
+//--------------------------------------------------------------------+
+// CDC telemetry
+//--------------------------------------------------------------------+
 
-            spk_buffers[current_spk_write_buffer].size     = buffer_pos;
-            spk_buffers[current_spk_write_buffer].position = 0;
-            spk_buffers[current_spk_write_buffer].ready    = true;
+// Runs from the main loop only, never from the SOF callback or the timer ISR.
+// Output goes through the CDC TX FIFO without blocking: a line that does not
+// fit is dropped and counted, and the FIFO is flushed once per batch.
+#define TELEMETRY_DEFAULT_PERIOD_MS 1000
+
+static uint32_t telemetry_period_ms = TELEMETRY_DEFAULT_PERIOD_MS;    // 0 - only on request
+static uint32_t telemetry_dropped   = 0;
+static bool     trace_streaming     = false;
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+static uint glitch_min_high_cycles = DETECTOR_MIN_HIGH_CYCLES;
+#endif
+
+static bool telemetry_write(const char *line) {
+    uint32_t len = (uint32_t)strlen(line);
+    if (tud_cdc_write_available() < len) {
+        telemetry_dropped++;
+        return false;
+    }
+    tud_cdc_write(line, len);
+    return true;
+}
 
-            current_spk_write_buffer = (uint8_t)((current_spk_write_buffer + 1) % 2);
+static void telemetry_report(void) {
+    char                  line[192];
+    jitter_stats_t        jb;
+    statistics_snapshot_t snap;
+
+    jitter_buffer_get_stats(&jb, true);
+
+    snprintf(line, sizeof(line), "rate=%lu bits=%u ppm_x100=%ld relocks=%lu slips=%lu\r\n",
+             current_sample_rate, ppm_code_bits, sof_ppm_error_q8 * 100 / 256, sof_relocks, pacing_slips);
+    telemetry_write(line);
+
+    snprintf(line, sizeof(line), "spk lost=%lu overruns=%lu underruns=%lu\r\n",
+             spk_lost_packets, spk_overruns, spk_underruns);
+    telemetry_write(line);
+
+    snprintf(line, sizeof(line), "jb depth=%u min=%u max=%u target=%u state=%u under=%lu over=%lu t=%lu/%lu/%lu\r\n",
+             jb.depth, jb.depth_min, jb.depth_max, jb.target, jb.state, jb.underruns, jb.overruns,
+             jb.frames_in_state[JB_PRIMING], jb.frames_in_state[JB_PLAYING], jb.frames_in_state[JB_UNDERRUN]);
+    telemetry_write(line);
+
+    statistics_snapshot(&snap);
+    snprintf(line, sizeof(line), "per_s usb_in=%lu sent=%lu received=%lu fifo=%lu fifo_drop=%lu usb_out=%lu bytes=%lu\r\n",
+             snap.per_second.total_pcm_received, snap.per_second.total_ppm_sent, snap.per_second.total_ppm_received,
+             snap.per_second.total_fifo_pushed, snap.per_second.total_fifo_dropped, snap.per_second.total_pcm_convert,
+             (uint32_t)snap.per_second.total_bytes_sent_to_usb);
+    telemetry_write(line);
+
+    // Timing noise plus code quantization against a full scale sine over the audio span
+    float sigma2     = (float)link_quality.pilot_var_q8 / 256.0f;
+    float noise_rms  = sqrtf(sigma2 + 1.0f / 12.0f);
+    float signal_rms = (float)ppm_audio_span(ppm_code_bits) / (2.0f * sqrtf(2.0f));
+    float snr_db     = 20.0f * log10f(signal_rms / noise_rms);
+    float ns_count   = PPM_GEN_CYCLES_PER_COUNT * 1000000.0f / SYS_FREQ;
+
+    // The estimate and the lane alignment only move at pilots; older than
+    // twice the longest pilot spacing they describe a link that may be gone
+    uint32_t pilot_age_ms = (time_us_32() - link_quality.pilot_at_us) / 1000;
+    bool     pilot_stale  = !link_quality.pilots ||
+                       pilot_age_ms > 2u * PPM_PILOT_AUDIO_INTERVAL * 1000 / current_sample_rate;
+    snprintf(line, sizeof(line), "lq jitter_ns=%.1f offset=%.2f invalid_ppm=%lu snr_db=%.1f enob=%.2f pilots=%lu pilot_age_ms=%lu%s\r\n",
+             sqrtf(sigma2) * ns_count, (float)link_quality.pilot_mean_q8 / 256.0f,
+             (uint32_t)(((uint64_t)link_quality.invalid_rate_q16 * 1000000) >> 16), snr_db, (snr_db - 1.76f) / 6.02f,
+             link_quality.pilots, pilot_age_ms, pilot_stale ? " stale" : "");
+    telemetry_write(line);
+
+#if DETECTOR_MODE == DETECTOR_PACKED
+    snprintf(line, sizeof(line), "pulse high_ns=%.1f bias_comp=%s\r\n",
+             (float)link_quality.pulse_high_q8 / 256.0f * ns_count, detector_bias_comp ? "on" : "off");
+    telemetry_write(line);
+#elif DETECTOR_MODE == DETECTOR_QUALIFIED
+    snprintf(line, sizeof(line), "glitch rejected=%lu min_high_cycles=%u\r\n", link_quality.glitches,
+             glitch_min_high_cycles);
+    telemetry_write(line);
+#elif DETECTOR_MODE == DETECTOR_DUAL
+    snprintf(line, sizeof(line), "dual phase_slips=%lu\r\n", link_quality.phase_slips);
+    telemetry_write(line);
+#endif
+
+#if PPM_LANES > 1
+    snprintf(line, sizeof(line), "lanes count=%u slips=%lu%s\r\n", PPM_LANES, link_quality.lane_slips,
+             pilot_stale ? " stale" : "");
+    telemetry_write(line);
+#else
+    // Transmitter symbol clock against ours, from the pulse timestamps; positive: transmitter is fast
+    uint32_t nominal_q8  = (uint32_t)(((uint64_t)clock_get_hz(clk_sys) << 8) / current_sample_rate);
+    int32_t  tx_ppm_x100 = (int32_t)(((int64_t)nominal_q8 - pulse_timing.period_q8) * 100000000 / nominal_q8);
+    snprintf(line, sizeof(line), "ts edges=%lu frames=%lu missing_start=%lu missing_end=%lu extra=%lu overruns=%lu tx_ppm_x100=%ld\r\n",
+             pulse_timing.edges, pulse_timing.frames, pulse_timing.missing_starts, pulse_timing.missing_ends,
+             pulse_timing.extra_edges, pulse_timing.overruns, tx_ppm_x100);
+    telemetry_write(line);
+#endif
+
+    snprintf(line, sizeof(line), "signal lost=%u losses=%lu relocks=%lu\r\n", signal_lost, signal_losses,
+             signal_relocks);
+    telemetry_write(line);
+
+    snprintf(line, sizeof(line), "marker sent=%lu received=%lu lost=%lu\r\n", markers_sent, markers_received,
+             markers_lost);
+    telemetry_write(line);
+    for (uint32_t i = 0; i < MARKER_STAGES; i++) {
+        const marker_hist_t *hist = &marker_hists[i];
+        if (!hist->count) {
+            continue;
         }
-        spk_data_size = 0;
+        snprintf(line, sizeof(line), "marker %s_us min=%lu p50=%lu p99=%lu max=%lu\r\n", marker_stage_names[i],
+                 hist->min_us, marker_hist_percentile(hist, 50), marker_hist_percentile(hist, 99), hist->max_us);
+        telemetry_write(line);
     }
+
+    snprintf(line, sizeof(line), "rx concealed=%lu dropouts=%lu invalid=%lu tlm_dropped=%lu\r\n",
+             plc_concealed, plc_dropouts, plc_invalid, telemetry_dropped);
+    telemetry_write(line);
 }
 
-void mic_task(void) {
-    static absolute_time_t last_fill_time;
+static void telemetry_command(char *cmd) {
+    char           *arg = strchr(cmd, ' ');
+    jitter_config_t config;
+
+    if (arg) {
+        *arg++ = '\0';
+    }
 
-    if (!tud_audio_mounted() || current_resolution != 16) {
+    if (!strcmp(cmd, "stats")) {
+        telemetry_report();
+    }
+    else if (!strcmp(cmd, "period") && arg) {
+        telemetry_period_ms = (uint32_t)strtoul(arg, NULL, 10);
+    }
+    else if (!strcmp(cmd, "lat")) {
+        // lat | lat reset
+        if (arg && !strcmp(arg, "reset")) {
+            latency_reset();
+        }
+        else {
+            char line[96];
+            for (uint32_t region = 0; latency_format((latency_region_t)region, line, sizeof(line)); region++) {
+                telemetry_write(line);
+            }
+        }
+    }
+    else if (!strcmp(cmd, "marker") && arg) {
+        // marker <ms>, 0 stops, the stage histograms start over
+        marker_interval_ms = (uint32_t)strtoul(arg, NULL, 10);
+        memset(marker_hists, 0, sizeof(marker_hists));
+    }
+    else if (!strcmp(cmd, "pilot") && arg) {
+        // pilot audio | idle, audio keeps the link estimate and lane alignment
+        // going while streaming at the cost of a held sample per pilot; idle
+        // still sends one in audio every PPM_PILOT_AUDIO_INTERVAL frames
+        pilot_in_audio = !strcmp(arg, "audio");
+    }
+    else if (!strcmp(cmd, "bias") && arg) {
+        // bias on | off, needs DETECTOR_PACKED
+        detector_bias_comp = !strcmp(arg, "on");
+    }
+    else if (!strcmp(cmd, "glitch") && arg) {
+        // glitch <cycles>, shortest accepted pulse, needs DETECTOR_QUALIFIED
+#if DETECTOR_MODE == DETECTOR_QUALIFIED
+        glitch_min_high_cycles = detector_set_min_high((uint)strtoul(arg, NULL, 10));
+#endif
+    }
+    else if (!strcmp(cmd, "trace") && arg) {
+        // trace on | off, the dump is interleaved with text lines
+        trace_streaming = !strcmp(arg, "on");
+    }
+    else if (!strcmp(cmd, "jb") && arg) {
+        // jb <target> | jb low | jb normal
+        jitter_buffer_get_config(&config);
+        if (!strcmp(arg, "low")) {
+            config.low_latency = true;
+        }
+        else if (!strcmp(arg, "normal")) {
+            config.low_latency = false;
+        }
+        else {
+            config.target_depth = (uint16_t)strtoul(arg, NULL, 10);
+        }
+        jitter_buffer_configure(&config);
+    }
+    else if (!strcmp(cmd, "under") && arg) {
+        // under repeat | silence | rebuffer
+        jitter_buffer_get_config(&config);
+        if (!strcmp(arg, "silence")) {
+            config.underrun = JB_UNDERRUN_SILENCE;
+        }
+        else if (!strcmp(arg, "rebuffer")) {
+            config.underrun = JB_UNDERRUN_REBUFFER;
+        }
+        else {
+            config.underrun = JB_UNDERRUN_REPEAT;
+        }
+        jitter_buffer_configure(&config);
+    }
+    else if (!strcmp(cmd, "over") && arg) {
+        // over oldest | newest | resync
+        jitter_buffer_get_config(&config);
+        if (!strcmp(arg, "newest")) {
+            config.overrun = JB_OVERRUN_DROP_NEWEST;
+        }
+        else if (!strcmp(arg, "resync")) {
+            config.overrun = JB_OVERRUN_RESYNC;
+        }
+        else {
+            config.overrun = JB_OVERRUN_DROP_OLDEST;
+        }
+        jitter_buffer_configure(&config);
+    }
+    else {
+        telemetry_write("commands: stats, period <ms>, lat [reset], marker <ms>, pilot audio|idle, trace on|off, "
+                        "jb <samples>|low|normal, "
+                        "under repeat|silence|rebuffer, over oldest|newest|resync\r\n");
         return;
     }
+    telemetry_write("ok\r\n");
+}
+
+// Binary dump frame: magic, core, event count, 2 pad bytes, running drop count
+// of that core's ring, then the trace_event_t records as laid out in memory.
+#define TRACE_FRAME_EVENTS 32
 
-    const uint16_t packet_size_bytes = 96;
+static void trace_task(void) {
+    // Events are read in place at frame + 12, keep them word aligned
+    static uint8_t frame[12 + TRACE_FRAME_EVENTS * sizeof(trace_event_t)] __attribute__((aligned(4)));
+
+    for (uint core = 0; core < 2; core++) {
+        if (tud_cdc_write_available() < sizeof(frame)) {
+            return;
+        }
 
-    // Initialize on first call or after sending
-    if (pcm_ticks_in_buffer == 0) {
-        memset(mic_buf, 0, packet_size_bytes);
-        mic_dst        = (int16_t *)mic_buf;
-        last_fill_time = get_absolute_time();
+        uint32_t dropped;
+        uint32_t count = trace_read(core, (trace_event_t *)(frame + 12), TRACE_FRAME_EVENTS, &dropped);
+        if (!count) {
+            continue;
+        }
+
+        uint32_t magic = TRACE_MAGIC;
+        memcpy(frame, &magic, 4);
+        frame[4] = (uint8_t)core;
+        frame[5] = (uint8_t)count;
+        frame[6] = 0;
+        frame[7] = 0;
+        memcpy(frame + 8, &dropped, 4);
+        tud_cdc_write(frame, 12 + count * sizeof(trace_event_t));
     }
+}
+
+void telemetry_task(void) {
+    static char     input[48];
+    static uint8_t  input_pos   = 0;
+    static uint32_t last_report = 0;
 
-    while (multicore_fifo_rvalid() && (pcm_ticks_in_buffer < packet_size_bytes)) {
-        uint32_t ppm_value = multicore_fifo_pop_blocking();
-        int16_t  pcm       = ppm_to_audio(ppm_value);
-        *mic_dst++         = pcm;
-        pcm_ticks_in_buffer += 2;
+    if (!tud_cdc_connected()) {
+        return;
+    }
+
+    while (tud_cdc_available()) {
+        char c;
+        tud_cdc_read(&c, 1);
+        if (c == '\r' || c == '\n') {
+            if (input_pos > 0) {
+                input[input_pos] = '\0';
+                telemetry_command(input);
+                input_pos = 0;
+            }
+        }
+        else if (input_pos < sizeof(input) - 1) {
+            input[input_pos++] = c;
+        }
     }
 
-    // Check sending conditions:
-    bool buffer_full     = (pcm_ticks_in_buffer >= packet_size_bytes);
-    bool timeout_expired = absolute_time_diff_us(last_fill_time, get_absolute_time()) >= 1000;
+    uint32_t now = board_millis();
+    if (telemetry_period_ms && now - last_report >= telemetry_period_ms) {
+        last_report = now;
+        telemetry_report();
+    }
 
-    if (buffer_full || (pcm_ticks_in_buffer > 0 && timeout_expired)) {
-        tud_audio_write((uint8_t *)mic_buf, pcm_ticks_in_buffer);
-        pcm_ticks_in_buffer = 0;
+    if (trace_streaming) {
+        trace_task();
     }
+
+    tud_cdc_write_flush();
 }
 
 // void mic_task(void) {
@@ -102,13 +102,22 @@ extern "C" {
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_CDC    0
+#define CFG_TUD_CDC    1
 #define CFG_TUD_MSC    0
 #define CFG_TUD_HID    0
 #define CFG_TUD_MIDI   0
 #define CFG_TUD_AUDIO  1
 #define CFG_TUD_VENDOR 0
 
+//--------------------------------------------------------------------
+// CDC CLASS DRIVER CONFIGURATION
+//--------------------------------------------------------------------
+
+// Telemetry lines are batched into the TX FIFO and sent in one go
+#define CFG_TUD_CDC_RX_BUFSIZE 64
+#define CFG_TUD_CDC_TX_BUFSIZE 512
+#define CFG_TUD_CDC_EP_BUFSIZE 64
+
 //--------------------------------------------------------------------
 // AUDIO CLASS DRIVER CONFIGURATION
 //--------------------------------------------------------------------
@@ -124,7 +133,7 @@ extern "C" {
 // Audio format type I specifications
 /* 24bit/48kHz is the best quality for headset or 24bit/96kHz for 2ch speaker,
    high-speed is needed beyond this */
-#define CFG_TUD_AUDIO_FUNC_1_MAX_SAMPLE_RATE 48000
+#define CFG_TUD_AUDIO_FUNC_1_MAX_SAMPLE_RATE 96000
 #define CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_TX   1
 #define CFG_TUD_AUDIO_FUNC_1_N_CHANNELS_RX   2
 
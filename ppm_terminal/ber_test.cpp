@@ -0,0 +1,237 @@
+#include "ber_test.h"
+#include "hardware/sync.h"
+#include <cmath>
+
+// Fibonacci LFSR. The state is the last `order` output bits with the newest
+// in bit 0, so a receiver can load it straight from received bits.
+class Prbs {
+  public:
+    void init(uint8_t order) {
+        order_ = order;
+        tap_   = order == 23 ? 18 : 14;
+        mask_  = (1u << order) - 1;
+        state_ = mask_;
+    }
+
+    uint32_t next_symbol() {
+        uint32_t symbol = 0;
+        for (int i = 0; i < BER_SYMBOL_BITS; i++) {
+            uint32_t bit = ((state_ >> (order_ - 1)) ^ (state_ >> (tap_ - 1))) & 1;
+            state_       = ((state_ << 1) | bit) & mask_;
+            symbol       = (symbol << 1) | bit;
+        }
+        return symbol;
+    }
+
+    void load_symbol(uint32_t symbol) {
+        state_ = ((state_ << BER_SYMBOL_BITS) | symbol) & mask_;
+    }
+
+    void     clear() { state_ = 0; }
+    uint32_t state() const { return state_; }
+
+  private:
+    uint8_t  order_ = 15;
+    uint8_t  tap_   = 14;
+    uint32_t mask_  = 0x7FFF;
+    uint32_t state_ = 0x7FFF;
+};
+
+//--------------------------------------------------------------------+
+// Transmitter
+//--------------------------------------------------------------------+
+
+static Prbs             tx_prbs;
+static volatile uint8_t tx_order = 0;
+
+// Tells core 0 which sequence to expect, there is no handshake over the air.
+// Generation in the upper bits so a restart with the same order clears the stats.
+static volatile uint32_t rx_request    = 0;
+static uint32_t          rx_generation = 0;
+
+bool ber_start(uint8_t order) {
+    if (order != 15 && order != 23) {
+        return false;
+    }
+    uint32_t irq_state = save_and_disable_interrupts();
+    tx_prbs.init(order);
+    tx_order = order;
+    restore_interrupts(irq_state);
+
+    rx_request = (++rx_generation << 8) | order;
+    return true;
+}
+
+void ber_stop() {
+    tx_order   = 0;
+    rx_request = ++rx_generation << 8;
+}
+
+bool ber_tx_active() {
+    return tx_order != 0;
+}
+
+uint32_t ber_tx_next_code() {
+    return BER_CODE_BASE + tx_prbs.next_symbol();
+}
+
+//--------------------------------------------------------------------+
+// Receiver
+//--------------------------------------------------------------------+
+
+enum class RxState : uint8_t {
+    Load,      // Filling the generator from received symbols
+    Verify,    // Generator loaded, waiting for BER_LOCK_SYMBOLS matches
+    Locked,
+};
+
+static Prbs     rx_prbs;
+static RxState  rx_state   = RxState::Load;
+static uint32_t rx_current = 0;    // Last rx_request taken over
+static uint8_t  rx_order   = 0;
+static uint8_t  rx_loaded  = 0;    // Symbols shifted in since the last reload
+static uint8_t  rx_matches;
+static uint8_t  rx_window_symbols;
+static uint8_t  rx_window_errors;
+
+// Written by core 0 only, core 1 copies it under the sequence counter
+static ber_stats_t       rx_stats     = {};
+static volatile uint32_t rx_stats_seq = 0;
+
+static void rx_reload() {
+    rx_prbs.clear();
+    rx_loaded = 0;
+    rx_state  = RxState::Load;
+}
+
+static void rx_load(uint32_t symbol) {
+    rx_prbs.load_symbol(symbol);
+    rx_loaded++;
+    if (rx_loaded * BER_SYMBOL_BITS >= rx_order && rx_prbs.state() != 0) {
+        rx_matches = 0;
+        rx_state   = RxState::Verify;
+    }
+}
+
+static void rx_count(uint32_t symbol, uint32_t expected, bool valid) {
+    rx_stats.symbols++;
+    rx_stats.bits += BER_SYMBOL_BITS;
+    rx_window_symbols++;
+
+    if (!valid) {
+        rx_stats.out_of_range++;
+        rx_stats.symbol_errors++;
+        rx_stats.bit_errors += BER_SYMBOL_BITS / 2;    // A random guess is right on half the bits
+        rx_window_errors++;
+    }
+    else if (symbol != expected) {
+        uint32_t magnitude = symbol > expected ? symbol - expected : expected - symbol;
+        uint32_t bucket    = 31 - __builtin_clz(magnitude);
+
+        rx_stats.magnitude[bucket < BER_MAG_BUCKETS ? bucket : BER_MAG_BUCKETS - 1]++;
+        rx_stats.symbol_errors++;
+        rx_stats.bit_errors += __builtin_popcount(symbol ^ expected);
+        rx_window_errors++;
+    }
+
+    if (rx_window_errors >= BER_UNLOCK_ERRORS) {
+        // Slipped or lost the signal, find the sequence again
+        rx_stats.resyncs++;
+        rx_stats.locked = false;
+        rx_reload();
+    }
+    if (rx_window_symbols >= BER_WINDOW) {
+        rx_window_symbols = 0;
+        rx_window_errors  = 0;
+    }
+}
+
+bool ber_rx_symbol(uint32_t width) {
+    uint32_t request = rx_request;
+
+    if (request != rx_current) {
+        rx_current = request;
+        rx_order   = static_cast<uint8_t>(request);
+        rx_stats_seq++;
+        __dmb();
+        rx_stats       = {};
+        rx_stats.order = rx_order;
+        __dmb();
+        rx_stats_seq++;
+        if (rx_order) {
+            rx_prbs.init(rx_order);
+            rx_reload();
+        }
+    }
+    if (!rx_order) {
+        return false;
+    }
+
+    bool     valid  = width >= BER_CODE_BASE && width < BER_CODE_BASE + (1u << BER_SYMBOL_BITS);
+    uint32_t symbol = width - BER_CODE_BASE;
+
+    switch (rx_state) {
+    case RxState::Load:
+        if (valid) {
+            rx_load(symbol);
+        }
+        break;
+
+    case RxState::Verify:
+        if (valid && symbol == rx_prbs.next_symbol()) {
+            if (++rx_matches >= BER_LOCK_SYMBOLS) {
+                rx_window_symbols = 0;
+                rx_window_errors  = 0;
+                rx_state          = RxState::Locked;
+                rx_stats.locked   = true;
+            }
+        }
+        else {
+            rx_reload();
+            if (valid) {
+                rx_load(symbol);
+            }
+        }
+        break;
+
+    case RxState::Locked:
+        rx_stats_seq++;
+        __dmb();
+        rx_count(symbol, rx_prbs.next_symbol(), valid);
+        __dmb();
+        rx_stats_seq++;
+        break;
+    }
+    return true;
+}
+
+void ber_get_stats(ber_stats_t &stats) {
+    uint32_t seq;
+    do {
+        seq = rx_stats_seq;
+        __dmb();
+        stats = rx_stats;
+        __dmb();
+    } while ((seq & 1) || seq != rx_stats_seq);
+}
+
+// 95% Wilson score interval, still meaningful with zero errors
+void ber_confidence(const ber_stats_t &stats, float &ber, float &low, float &high) {
+    const float z = 1.96f;
+
+    if (stats.bits == 0) {
+        ber = low = 0.0f;
+        high      = 1.0f;
+        return;
+    }
+
+    float n      = static_cast<float>(stats.bits);
+    float p      = static_cast<float>(stats.bit_errors) / n;
+    float denom  = 1.0f + z * z / n;
+    float center = (p + z * z / (2.0f * n)) / denom;
+    float half   = z * sqrtf(p * (1.0f - p) / n + z * z / (4.0f * n * n)) / denom;
+
+    ber  = p;
+    low  = center > half ? center - half : 0.0f;
+    high = center + half;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+
+// Bit error rate tester.
+// The transmitter streams a PRBS-15 (x^15 + x^14 + 1) or PRBS-23
+// (x^23 + x^18 + 1) sequence cut into 10 bit symbols, MSB first, sent as codes
+// BER_CODE_BASE..BER_CODE_BASE + 1023 at the full symbol rate. The receiver
+// loads its own generator from the first received symbols and then predicts
+// every symbol, so an error never propagates and a lost pulse only costs a
+// resync.
+#define BER_SYMBOL_BITS   10
+#define BER_CODE_BASE     1     // Code 0 stays the idle pulse pair
+#define BER_LOCK_SYMBOLS  16    // Consecutive matches needed to declare lock
+#define BER_WINDOW        64    // Symbols per lock check window
+#define BER_UNLOCK_ERRORS 16    // Errors within one window that drop the lock
+#define BER_MAG_BUCKETS   10    // |received - expected|: 1, 2-3, 4-7, ..., 512-1023
+
+struct ber_stats_t {
+    uint64_t symbols;          // Compared while locked
+    uint64_t bits;
+    uint64_t symbol_errors;
+    uint64_t bit_errors;
+    uint32_t out_of_range;     // Widths outside the code range, counted as symbol errors too
+    uint32_t magnitude[BER_MAG_BUCKETS];
+    uint32_t resyncs;          // Lock lost and found again
+    bool     locked;
+    uint8_t  order;            // 15 or 23, 0 - BER mode off
+};
+
+// Control and transmit side, core 1. ber_tx_next_code runs in the timer ISR.
+bool     ber_start(uint8_t order);
+void     ber_stop();
+bool     ber_tx_active();
+uint32_t ber_tx_next_code();
+void     ber_get_stats(ber_stats_t &stats);
+void     ber_confidence(const ber_stats_t &stats, float &ber, float &low, float &high);
+
+// Receive side, core 0. Returns true while BER mode owns the detector.
+bool ber_rx_symbol(uint32_t width);
@@ -0,0 +1,241 @@
+#include "data_link.h"
+#include "hardware/sync.h"
+
+link_stats_t link_stats = {};
+
+//--------------------------------------------------------------------+
+// CRC-32 (IEEE 802.3, same as zlib.crc32 on the host)
+//--------------------------------------------------------------------+
+
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+uint32_t link_crc32(const uint8_t *data, size_t len, uint32_t crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+//--------------------------------------------------------------------+
+// Transmitter
+//--------------------------------------------------------------------+
+
+#define LINK_TX_RING 1024    // Symbols, power of 2
+
+static uint16_t          tx_ring[LINK_TX_RING];
+static volatile uint16_t tx_head = 0;    // Free running, main loop
+static volatile uint16_t tx_tail = 0;    // Free running, timer ISR
+
+size_t link_tx_free() {
+    return LINK_TX_RING - static_cast<uint16_t>(tx_head - tx_tail);
+}
+
+// Packs bytes into symbols, LSB first
+class SymbolPacker {
+  public:
+    explicit SymbolPacker(uint16_t &head) : head_(head) {}
+
+    void push_byte(uint8_t byte) {
+        acc_ |= static_cast<uint32_t>(byte) << bits_;
+        bits_ += 8;
+        while (bits_ >= LINK_SYMBOL_BITS) {
+            push_code(LINK_CODE_BASE + (acc_ & ((1u << LINK_SYMBOL_BITS) - 1)));
+            acc_ >>= LINK_SYMBOL_BITS;
+            bits_ -= LINK_SYMBOL_BITS;
+        }
+    }
+
+    void flush() {
+        if (bits_) {
+            push_code(LINK_CODE_BASE + acc_);
+            acc_  = 0;
+            bits_ = 0;
+        }
+    }
+
+    void push_code(uint32_t code) {
+        tx_ring[head_++ & (LINK_TX_RING - 1)] = static_cast<uint16_t>(code);
+    }
+
+  private:
+    uint16_t &head_;
+    uint32_t  acc_  = 0;
+    uint8_t   bits_ = 0;
+};
+
+bool link_tx_queue_frame(const uint8_t *payload, uint16_t len) {
+    if (len == 0 || len > LINK_MAX_PAYLOAD || link_tx_free() < LINK_MAX_SYMBOLS) {
+        return false;
+    }
+
+    uint8_t  header[2] = {static_cast<uint8_t>(len), static_cast<uint8_t>(len >> 8)};
+    uint32_t crc       = link_crc32(payload, len, link_crc32(header, sizeof(header)));
+    uint16_t head      = tx_head;
+
+    SymbolPacker packer(head);
+    packer.push_code(LINK_SYNC_CODE);
+    packer.push_byte(header[0]);
+    packer.push_byte(header[1]);
+    for (uint16_t i = 0; i < len; i++) {
+        packer.push_byte(payload[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        packer.push_byte(static_cast<uint8_t>(crc >> (8 * i)));
+    }
+    packer.flush();
+
+    // Publish the whole frame at once, the ISR never sees half of it
+    tx_head = head;
+
+    link_stats.frames_sent++;
+    link_stats.bytes_sent += len;
+    return true;
+}
+
+// Frames sit back to back in the ring, each starting with its sync code, so
+// any other code next means a frame is half sent
+bool link_tx_in_frame() {
+    uint16_t tail = tx_tail;
+    return tail != tx_head && tx_ring[tail & (LINK_TX_RING - 1)] != LINK_SYNC_CODE;
+}
+
+bool link_tx_pop_code(uint32_t &code) {
+    uint16_t tail = tx_tail;
+    if (tail == tx_head) {
+        return false;
+    }
+    code    = tx_ring[tail & (LINK_TX_RING - 1)];
+    tx_tail = static_cast<uint16_t>(tail + 1);
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// Receiver
+//--------------------------------------------------------------------+
+
+#define LINK_RX_RING 4096    // Bytes, power of 2
+
+static uint8_t           rx_ring[LINK_RX_RING];
+static volatile uint32_t rx_head = 0;    // Free running, core 0
+static volatile uint32_t rx_tail = 0;    // Free running, core 1
+
+enum class RxState {
+    Hunt,      // Waiting for a sync symbol
+    Header,    // Collecting the length
+    Body,      // Collecting payload and CRC
+};
+
+static RxState  rx_state = RxState::Hunt;
+static uint32_t rx_acc;
+static uint8_t  rx_bits;
+static uint16_t rx_len;
+static uint16_t rx_pos;
+static uint8_t  rx_frame[2 + LINK_MAX_PAYLOAD + 4];
+
+static void rx_start_frame() {
+    rx_state = RxState::Header;
+    rx_acc   = 0;
+    rx_bits  = 0;
+    rx_pos   = 0;
+}
+
+static void rx_commit_frame() {
+    uint32_t crc = static_cast<uint32_t>(rx_frame[2 + rx_len]) |
+                   static_cast<uint32_t>(rx_frame[3 + rx_len]) << 8 |
+                   static_cast<uint32_t>(rx_frame[4 + rx_len]) << 16 |
+                   static_cast<uint32_t>(rx_frame[5 + rx_len]) << 24;
+
+    if (link_crc32(rx_frame, 2u + rx_len) != crc) {
+        link_stats.crc_errors++;
+        return;
+    }
+
+    uint32_t head = rx_head;
+    if (LINK_RX_RING - (head - rx_tail) < rx_len) {
+        link_stats.rx_overflows++;
+        return;
+    }
+    for (uint16_t i = 0; i < rx_len; i++) {
+        rx_ring[head++ & (LINK_RX_RING - 1)] = rx_frame[2 + i];
+    }
+    __dmb();
+    rx_head = head;
+
+    link_stats.frames_received++;
+    link_stats.bytes_received += rx_len;
+}
+
+bool link_rx_symbol(uint32_t width) {
+    bool is_sync = width >= LINK_SYNC_CODE - LINK_SYNC_TOL && width <= LINK_SYNC_CODE + LINK_SYNC_TOL;
+    bool is_data = width >= LINK_CODE_BASE && width < LINK_SYNC_CODE - LINK_SYNC_TOL;
+
+    if (is_sync) {
+        if (rx_state != RxState::Hunt) {
+            link_stats.aborted++;
+        }
+        rx_start_frame();
+        return true;
+    }
+    if (rx_state == RxState::Hunt) {
+        return false;
+    }
+    if (!is_data) {
+        link_stats.aborted++;
+        rx_state = RxState::Hunt;
+        return true;
+    }
+
+    // Codes slightly above the data range are detector error on the top code
+    uint32_t symbol = width - LINK_CODE_BASE;
+    if (symbol >= (1u << LINK_SYMBOL_BITS)) {
+        symbol = (1u << LINK_SYMBOL_BITS) - 1;
+    }
+
+    rx_acc |= symbol << rx_bits;
+    rx_bits += LINK_SYMBOL_BITS;
+    while (rx_bits >= 8) {
+        rx_frame[rx_pos++] = static_cast<uint8_t>(rx_acc);
+        rx_acc >>= 8;
+        rx_bits -= 8;
+
+        if (rx_state == RxState::Header && rx_pos == 2) {
+            rx_len = static_cast<uint16_t>(rx_frame[0] | rx_frame[1] << 8);
+            if (rx_len == 0 || rx_len > LINK_MAX_PAYLOAD) {
+                link_stats.aborted++;
+                rx_state = RxState::Hunt;
+                return true;
+            }
+            rx_state = RxState::Body;
+        }
+        else if (rx_state == RxState::Body && rx_pos == 2 + rx_len + 4) {
+            // Padding bits of the last symbol are dropped with the state
+            rx_commit_frame();
+            rx_state = RxState::Hunt;
+            return true;
+        }
+    }
+    return true;
+}
+
+size_t link_rx_available() {
+    return rx_head - rx_tail;
+}
+
+size_t link_rx_read(uint8_t *dst, size_t max) {
+    uint32_t tail  = rx_tail;
+    size_t   count = rx_head - tail;
+    if (count > max) {
+        count = max;
+    }
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = rx_ring[tail++ & (LINK_RX_RING - 1)];
+    }
+    __dmb();
+    rx_tail = tail;
+    return count;
+}
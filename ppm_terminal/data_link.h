@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common.h"
+#include <cstddef>
+
+// Raw data link over PPM.
+// Bytes are packed LSB first into 10 bit symbols and sent as codes
+// LINK_CODE_BASE..LINK_CODE_BASE + 1023, code 0 stays the idle pulse pair.
+// A frame is
+//   SYNC | length (16 bit LE) | payload | CRC-32 (LE, over length + payload)
+// padded with zero bits to a whole symbol. The sync code sits above the data
+// range with a guard, so a +-1 detector error cannot turn data into a sync.
+#define LINK_SYMBOL_BITS 10
+#define LINK_CODE_BASE   1
+#define LINK_SYNC_CODE   (LINK_CODE_BASE + (1 << LINK_SYMBOL_BITS) + 32)
+#define LINK_SYNC_TOL    16
+#define LINK_MAX_PAYLOAD 256
+#define LINK_MAX_SYMBOLS (1 + ((2 + LINK_MAX_PAYLOAD + 4) * 8 + LINK_SYMBOL_BITS - 1) / LINK_SYMBOL_BITS)
+
+struct link_stats_t {
+    volatile uint32_t frames_sent;
+    volatile uint32_t bytes_sent;
+    volatile uint32_t frames_received;
+    volatile uint32_t bytes_received;
+    volatile uint32_t crc_errors;
+    volatile uint32_t aborted;         // Frame cut short by an idle, invalid or sync symbol
+    volatile uint32_t rx_overflows;    // Good frames dropped because the host did not keep up
+};
+
+extern link_stats_t link_stats;
+
+uint32_t link_crc32(const uint8_t *data, size_t len, uint32_t crc = 0);
+
+// Transmit side, core 1. Frames are queued from the main loop and sent one
+// symbol per timer tick. Once a frame has started nothing else may take a
+// tick until it is through, link_tx_in_frame tells the ISR.
+size_t link_tx_free();
+bool   link_tx_queue_frame(const uint8_t *payload, uint16_t len);
+bool   link_tx_in_frame();
+bool   link_tx_pop_code(uint32_t &code);
+
+// Receive side. link_rx_symbol runs on core 0 for every measured width and
+// returns true if the width belonged to the link (sync or inside a frame).
+// link_rx_read hands decoded payload bytes to core 1.
+bool   link_rx_symbol(uint32_t width);
+size_t link_rx_available();
+size_t link_rx_read(uint8_t *dst, size_t max);
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+Тест пропускной способности канала данных PPM через vendor-интерфейс
+Передает поток блоков через лазерную пару (петля TX -> RX) и проверяет
+принятые данные, считает скорость и потери
+"""
+
+import argparse
+import struct
+import threading
+import time
+
+import usb.core
+import usb.util
+
+VID = 0xCAFE
+VENDOR_CLASS = 0xFF
+
+# Блок: номер (u32) и его инверсия (u32), по ним приемник находит границы
+BLOCK = struct.Struct("<II")
+
+
+def find_link(vid, pid):
+    """Найти устройство и bulk-точки vendor-интерфейса"""
+    dev = usb.core.find(idVendor=vid, idProduct=pid) if pid else usb.core.find(idVendor=vid)
+    if dev is None:
+        raise SystemExit(f"Устройство {vid:04x}:{pid or 0:04x} не найдено")
+
+    cfg = dev.get_active_configuration()
+    for itf in cfg:
+        if itf.bInterfaceClass != VENDOR_CLASS:
+            continue
+        if dev.is_kernel_driver_active(itf.bInterfaceNumber):
+            dev.detach_kernel_driver(itf.bInterfaceNumber)
+        usb.util.claim_interface(dev, itf.bInterfaceNumber)
+        ep_out = usb.util.find_descriptor(
+            itf,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_OUT,
+        )
+        ep_in = usb.util.find_descriptor(
+            itf,
+            custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress)
+            == usb.util.ENDPOINT_IN,
+        )
+        return dev, ep_out, ep_in
+    raise SystemExit("Vendor-интерфейс не найден")
+
+
+class LoopbackTest:
+    def __init__(self, ep_out, ep_in, duration, chunk):
+        self.ep_out = ep_out
+        self.ep_in = ep_in
+        self.duration = duration
+        self.chunk = chunk - chunk % BLOCK.size
+        self.running = True
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self.blocks_sent = 0
+        self.blocks_ok = 0
+        self.blocks_lost = 0
+        self.junk_bytes = 0
+
+    def writer(self):
+        seq = 0
+        while self.running:
+            data = b"".join(
+                BLOCK.pack(seq + i, ~(seq + i) & 0xFFFFFFFF)
+                for i in range(self.chunk // BLOCK.size)
+            )
+            try:
+                self.ep_out.write(data, timeout=1000)
+            except usb.core.USBTimeoutError:
+                continue
+            seq += self.chunk // BLOCK.size
+            self.blocks_sent = seq
+            self.bytes_sent += len(data)
+
+    def reader(self):
+        pending = b""
+        expected = 0
+        while self.running:
+            try:
+                data = bytes(self.ep_in.read(512, timeout=200))
+            except usb.core.USBTimeoutError:
+                continue
+            self.bytes_received += len(data)
+            pending += data
+
+            # Ищем блоки, при ошибке сдвигаемся на байт
+            pos = 0
+            while len(pending) - pos >= BLOCK.size:
+                seq, inv = BLOCK.unpack_from(pending, pos)
+                if seq ^ inv != 0xFFFFFFFF:
+                    pos += 1
+                    self.junk_bytes += 1
+                    continue
+                if seq >= expected:
+                    self.blocks_lost += seq - expected
+                    self.blocks_ok += 1
+                    expected = seq + 1
+                pos += BLOCK.size
+            pending = pending[pos:]
+
+    def run(self):
+        threads = [
+            threading.Thread(target=self.writer, daemon=True),
+            threading.Thread(target=self.reader, daemon=True),
+        ]
+        start = time.monotonic()
+        for t in threads:
+            t.start()
+
+        last = start
+        last_rx = 0
+        while time.monotonic() - start < self.duration:
+            time.sleep(1.0)
+            now = time.monotonic()
+            rate = (self.bytes_received - last_rx) / (now - last)
+            print(
+                f"{now - start:6.1f} с: {rate / 1000:8.2f} кБ/с, "
+                f"принято {self.blocks_ok}, потеряно {self.blocks_lost}"
+            )
+            last, last_rx = now, self.bytes_received
+
+        self.running = False
+        time.sleep(0.5)
+        elapsed = time.monotonic() - start
+
+        print("\nИтог:")
+        print(f"  Отправлено: {self.bytes_sent} байт")
+        print(f"  Принято:    {self.bytes_received} байт")
+        print(f"  Скорость:   {self.bytes_received / elapsed / 1000:.2f} кБ/с")
+        print(f"  Блоки:      {self.blocks_ok} целых, {self.blocks_lost} потеряно")
+        print(f"  Мусор:      {self.junk_bytes} байт")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Тест канала данных PPM")
+    parser.add_argument("--vid", type=lambda x: int(x, 0), default=VID)
+    parser.add_argument("--pid", type=lambda x: int(x, 0), default=None)
+    parser.add_argument("--duration", type=float, default=10.0, help="Длительность, с")
+    parser.add_argument(
+        "--chunk", type=int, default=256, help="Размер одной записи в USB, байт"
+    )
+    args = parser.parse_args()
+
+    _, ep_out, ep_in = find_link(args.vid, args.pid)
+    LoopbackTest(ep_out, ep_in, args.duration, args.chunk).run()
+
+
+if __name__ == "__main__":
+    main()
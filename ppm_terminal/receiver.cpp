@@ -1,4 +1,7 @@
+#include "ber_test.h"
 #include "common.h"
+#include "data_link.h"
+#include "sweep.h"
 #include <pico/stdlib.h>
 
 static PIO           pio = pio0;
@@ -12,6 +15,21 @@ void update_measurements() {
 
         uint32_t corrected_width = (measured_width + MIN_TACKT) - MIN_INTERVAL_CYCLES;
 
+        // BER mode owns the detector while it runs
+        if (ber_rx_symbol(corrected_width)) {
+            continue;
+        }
+
+        // So does a sweep
+        if (sweep_rx_symbol(corrected_width)) {
+            continue;
+        }
+
+        // Link frames go to the vendor interface, everything else to the terminal
+        if (link_rx_symbol(corrected_width)) {
+            continue;
+        }
+
         if (corrected_width > 0) {
             if (multicore_fifo_wready()) {
                 multicore_fifo_push_blocking(corrected_width);
@@ -44,6 +62,7 @@ void start_detector() {
 // Main function for Core0 (receiver)
 void first_core_main() {
     init_pulse_detector(PIO_FREQ);
+    sampler_init(pio, PIO_FREQ);
     start_detector();
 
     bool led_state = false;
@@ -53,6 +72,7 @@ void first_core_main() {
     while (1) {
 
         update_measurements();
+        sweep_rx_task();
 
         if (absolute_time_diff_us(get_absolute_time(), next_led_toggle) <= 0) {
             led_state = !led_state;
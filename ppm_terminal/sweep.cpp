@@ -0,0 +1,307 @@
+#include "sweep.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#include <cmath>
+
+// Running sums of offsets in cycles
+struct Moments {
+    uint32_t n    = 0;
+    int64_t  sum  = 0;
+    uint64_t sum2 = 0;
+
+    void add(int32_t value) {
+        n++;
+        sum += value;
+        sum2 += static_cast<uint64_t>(static_cast<int64_t>(value) * value);
+    }
+
+    float mean() const { return n ? static_cast<float>(sum) / n : 0.0f; }
+
+    float sd() const {
+        if (n < 2) {
+            return 0.0f;
+        }
+        float m   = mean();
+        float var = static_cast<float>(sum2) / n - m * m;
+        return var > 0.0f ? sqrtf(var) : 0.0f;
+    }
+};
+
+//--------------------------------------------------------------------+
+// Transmitter
+//--------------------------------------------------------------------+
+
+enum class TxState : uint8_t {
+    Off,
+    Settling,     // Code changed, waiting for SWEEP_SETTLE_MS
+    Measuring,    // Core 0 owns the point
+};
+
+static volatile uint32_t tx_code   = 0;
+static volatile bool     tx_active = false;
+static TxState           tx_state  = TxState::Off;
+static uint32_t          tx_last;
+static uint32_t          tx_step;
+static absolute_time_t   tx_deadline;
+
+// Generation in the upper bits, then the active flag and the code. Core 0
+// takes a point over when the request changes and hands the same request
+// back in rx_done once rx_result is written.
+#define SWEEP_RX_ACTIVE 0x800u
+#define SWEEP_RX_CODE   0x7FFu
+
+static volatile uint32_t rx_request    = 0;
+static uint32_t          rx_generation = 0;
+static uint32_t          tx_request    = 0;    // Last point handed to core 0
+static volatile uint32_t rx_done       = 0;
+static sweep_point_t     rx_result;
+
+bool sweep_start(uint32_t first, uint32_t last, uint32_t step) {
+    if (step == 0 || first > last || last > MAX_CODE) {
+        return false;
+    }
+    tx_code     = first;
+    tx_last     = last;
+    tx_step     = step;
+    tx_active   = true;
+    tx_state    = TxState::Settling;
+    tx_deadline = make_timeout_time_ms(SWEEP_SETTLE_MS);
+    return true;
+}
+
+void sweep_stop() {
+    tx_active  = false;
+    tx_state   = TxState::Off;
+    rx_request = ++rx_generation << 12;
+}
+
+bool sweep_tx_active() {
+    return tx_active;
+}
+
+uint32_t sweep_tx_code() {
+    return tx_code;
+}
+
+bool sweep_poll(sweep_point_t &point) {
+    switch (tx_state) {
+    case TxState::Off:
+        return false;
+
+    case TxState::Settling:
+        if (absolute_time_diff_us(get_absolute_time(), tx_deadline) <= 0) {
+            tx_request = (++rx_generation << 12) | SWEEP_RX_ACTIVE | tx_code;
+            rx_request = tx_request;
+            tx_state   = TxState::Measuring;
+        }
+        return false;
+
+    case TxState::Measuring:
+        if (rx_done != tx_request) {
+            return false;
+        }
+        __dmb();
+        point = rx_result;
+        if (tx_code + tx_step > tx_last) {
+            sweep_stop();
+        }
+        else {
+            tx_code += tx_step;
+            tx_state    = TxState::Settling;
+            tx_deadline = make_timeout_time_ms(SWEEP_SETTLE_MS);
+        }
+        return true;
+    }
+    return false;
+}
+
+//--------------------------------------------------------------------+
+// Receiver
+//--------------------------------------------------------------------+
+
+enum class CaptureState : uint8_t {
+    Idle,
+    Busy,    // DMA filling the burst
+    Scan,    // Finding edges, SAMPLER_SLICE words per call
+};
+
+// Words scanned per sweep_rx_task call, short enough that the detector FIFO
+// does not fill up in the meantime
+#define SAMPLER_SLICE 256
+
+static PIO          smp_pio;
+static uint         smp_sm;
+static uint         smp_dma;
+static uint32_t     smp_buffer[SAMPLER_WORDS];
+static CaptureState smp_state = CaptureState::Idle;
+static uint32_t     smp_pos;
+static uint32_t     smp_level;
+static uint32_t     smp_fall;
+static bool         smp_have_fall;
+static bool         smp_skip_gap;    // Next low stretch is the gap after a pair
+
+static uint32_t        rx_current = 0;    // Last rx_request taken over
+static bool            rx_collecting;
+static uint32_t        rx_code;
+static uint32_t        rx_widths;    // Seen for this point, accepted or not
+static uint8_t         rx_captures;
+static absolute_time_t rx_deadline;
+static Moments         rx_det;
+static Moments         rx_smp;
+
+void sampler_init(PIO pio, float freq) {
+    smp_pio              = pio;
+    smp_sm               = pio_claim_unused_sm(pio, true);
+    uint          offset = pio_add_program(pio, &pulse_sampler_program);
+    pio_sm_config c      = pulse_sampler_program_get_default_config(offset);
+
+    // Oldest sample ends up in bit 0
+    sm_config_set_in_pins(&c, PULSE_DET_PIN);
+    sm_config_set_in_shift(&c, true, true, 32);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / freq);
+    pio_sm_init(pio, smp_sm, offset, &c);
+
+    smp_dma = static_cast<uint>(dma_claim_unused_channel(true));
+}
+
+static void sampler_capture() {
+    dma_channel_config d = dma_channel_get_default_config(smp_dma);
+    channel_config_set_transfer_data_size(&d, DMA_SIZE_32);
+    channel_config_set_read_increment(&d, false);
+    channel_config_set_write_increment(&d, true);
+    channel_config_set_dreq(&d, pio_get_dreq(smp_pio, smp_sm, false));
+
+    pio_sm_clear_fifos(smp_pio, smp_sm);
+    pio_sm_restart(smp_pio, smp_sm);
+    dma_channel_configure(smp_dma, &d, smp_buffer, &smp_pio->rxf[smp_sm], SAMPLER_WORDS, true);
+    pio_sm_set_enabled(smp_pio, smp_sm, true);
+}
+
+// Every set bit of x is a sample that differs from the current level. The
+// edge is the lowest one; after it the level flips, so the bits that differ
+// from the new level are the clear ones above it.
+// Low stretches alternate between the pause inside a pair and the gap to the
+// next pair, so once a pause matched the low stretch after it is skipped; a
+// gap near the nominal width would otherwise be taken for a pause.
+static void sampler_scan_word(uint32_t word, uint32_t index) {
+    uint32_t nominal = 2 * (MIN_INTERVAL_CYCLES + rx_code) + 3;
+    uint32_t x       = smp_level ? ~word : word;
+
+    while (x) {
+        uint32_t bit = static_cast<uint32_t>(__builtin_ctz(x));
+        uint32_t t   = index * 32 + bit;
+
+        if (smp_level) {
+            smp_fall      = t;
+            smp_have_fall = true;
+        }
+        else if (smp_skip_gap) {
+            smp_skip_gap = false;
+        }
+        else if (smp_have_fall) {
+            int32_t offset = static_cast<int32_t>(t - smp_fall) - static_cast<int32_t>(nominal);
+            if (offset >= -SWEEP_MATCH_CYCLES && offset <= SWEEP_MATCH_CYCLES) {
+                rx_smp.add(offset);
+                smp_skip_gap = true;
+            }
+        }
+        smp_level ^= 1;
+        x = ~x & ~((2u << bit) - 1);
+    }
+}
+
+static void sampler_task() {
+    switch (smp_state) {
+    case CaptureState::Idle:
+        if (rx_captures < SWEEP_CAPTURES) {
+            sampler_capture();
+            smp_state = CaptureState::Busy;
+        }
+        break;
+
+    case CaptureState::Busy:
+        if (dma_channel_is_busy(smp_dma)) {
+            break;
+        }
+        pio_sm_set_enabled(smp_pio, smp_sm, false);
+        smp_pos       = 0;
+        smp_level     = smp_buffer[0] & 1;
+        smp_have_fall = false;
+        smp_skip_gap  = false;
+        smp_state     = CaptureState::Scan;
+        break;
+
+    case CaptureState::Scan:
+        for (uint32_t end = smp_pos + SAMPLER_SLICE; smp_pos < end && smp_pos < SAMPLER_WORDS; smp_pos++) {
+            sampler_scan_word(smp_buffer[smp_pos], smp_pos);
+        }
+        if (smp_pos >= SAMPLER_WORDS) {
+            rx_captures++;
+            smp_state = CaptureState::Idle;
+        }
+        break;
+    }
+}
+
+static void rx_take_request() {
+    uint32_t request = rx_request;
+    if (request == rx_current) {
+        return;
+    }
+    rx_current    = request;
+    rx_collecting = request & SWEEP_RX_ACTIVE;
+    rx_code       = request & SWEEP_RX_CODE;
+    rx_widths     = 0;
+    rx_captures   = 0;
+    rx_deadline   = make_timeout_time_ms(SWEEP_TIMEOUT_MS);
+    rx_det        = Moments();
+    rx_smp        = Moments();
+
+    // A burst of the previous point is dropped
+    if (smp_state == CaptureState::Busy) {
+        dma_channel_abort(smp_dma);
+        pio_sm_set_enabled(smp_pio, smp_sm, false);
+    }
+    smp_state = CaptureState::Idle;
+}
+
+bool sweep_rx_symbol(uint32_t width) {
+    rx_take_request();
+    if (!(rx_current & SWEEP_RX_ACTIVE)) {
+        return false;
+    }
+    if (rx_collecting && rx_widths < SWEEP_WIDTHS) {
+        rx_widths++;
+        // Counts are 2 cycles
+        int32_t offset = 2 * (static_cast<int32_t>(width) - static_cast<int32_t>(rx_code));
+        if (offset >= -SWEEP_MATCH_CYCLES && offset <= SWEEP_MATCH_CYCLES) {
+            rx_det.add(offset);
+        }
+    }
+    return true;
+}
+
+void sweep_rx_task() {
+    rx_take_request();
+    if (!rx_collecting) {
+        return;
+    }
+    sampler_task();
+
+    bool widths_done = rx_widths >= SWEEP_WIDTHS || absolute_time_diff_us(get_absolute_time(), rx_deadline) <= 0;
+    if (!widths_done || rx_captures < SWEEP_CAPTURES) {
+        return;
+    }
+
+    rx_result.code       = rx_code;
+    rx_result.det_count  = rx_det.n;
+    rx_result.det_offset = rx_det.mean();
+    rx_result.det_sd     = rx_det.sd();
+    rx_result.smp_count  = rx_smp.n;
+    rx_result.smp_offset = rx_smp.mean();
+    rx_result.smp_sd     = rx_smp.sd();
+    __dmb();
+    rx_done       = rx_current;
+    rx_collecting = false;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+
+// Detector characterization sweep.
+// pulse_detector resolves a pause to 2 cycles (jmp pin + jmp y-- per count).
+// pulse_sampler runs next to it on the same pin and shifts the pin into the
+// ISR every cycle; DMA copies a burst of these words to RAM and a ctz pass
+// finds the edges, so the sampler resolves a pause to 1 cycle. It is too
+// heavy to run continuously (one word per 32 cycles), the sweep uses it in
+// bursts to compare the two designs.
+// The transmitter steps through the codes and holds each one. For every code
+// the receiver collects SWEEP_WIDTHS detector widths and SWEEP_CAPTURES
+// sampler bursts and reports both as the offset from the nominal pause and
+// its standard deviation, in cycles.
+#define SWEEP_WIDTHS       256     // pulse_detector widths per code
+#define SWEEP_CAPTURES     4       // Sampler bursts per code
+#define SWEEP_SETTLE_MS    5       // After the transmitter changes the code
+#define SWEEP_TIMEOUT_MS   500     // A code without signal is reported with what arrived
+#define SWEEP_MATCH_CYCLES 64      // Sampled pauses this close to the nominal one belong to the code
+#define SAMPLER_WORDS      4096    // One burst, 32 samples per word
+
+struct sweep_point_t {
+    uint32_t code;
+    uint32_t det_count;
+    float    det_offset;    // Cycles, mean of measured - nominal
+    float    det_sd;        // Cycles
+    uint32_t smp_count;
+    float    smp_offset;
+    float    smp_sd;
+};
+
+// Control and transmit side, core 1. sweep_tx_code runs in the timer ISR,
+// sweep_poll in the main loop and returns true for every finished code.
+bool     sweep_start(uint32_t first, uint32_t last, uint32_t step);
+void     sweep_stop();
+bool     sweep_tx_active();
+uint32_t sweep_tx_code();
+bool     sweep_poll(sweep_point_t &point);
+
+// Receive side, core 0. sweep_rx_symbol returns true while the sweep owns
+// the detector, sweep_rx_task runs the sampler bursts a slice at a time.
+void sampler_init(PIO pio, float freq);
+bool sweep_rx_symbol(uint32_t width);
+void sweep_rx_task();
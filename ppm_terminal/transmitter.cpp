@@ -1,5 +1,10 @@
+#include "ber_test.h"
 #include "common.h"
+#include "data_link.h"
+#include "sweep.h"
 #include <bsp/board_api.h>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <tusb.h>
@@ -23,10 +28,25 @@ void timer0_irq_handler() {
         timer_hw->intr = 1u << 0;
 
         uint32_t ppm_value;
-        if (has_custom_value) {
+        uint32_t link_code;
+        // A started link frame goes first, any other code inside it would
+        // break its CRC; custom codes, BER and sweep wait for its end
+        if (link_tx_in_frame() && link_tx_pop_code(link_code)) {
+            ppm_value = MIN_INTERVAL_CYCLES + link_code;
+        }
+        else if (has_custom_value) {
             ppm_value        = MIN_INTERVAL_CYCLES + ppm_code_to_send;
             has_custom_value = false;
         }
+        else if (ber_tx_active()) {
+            ppm_value = MIN_INTERVAL_CYCLES + ber_tx_next_code();
+        }
+        else if (sweep_tx_active()) {
+            ppm_value = MIN_INTERVAL_CYCLES + sweep_tx_code();
+        }
+        else if (link_tx_pop_code(link_code)) {
+            ppm_value = MIN_INTERVAL_CYCLES + link_code;
+        }
         else {
             ppm_value = MIN_INTERVAL_CYCLES;
         }
@@ -54,8 +74,120 @@ void init_pulse_generator(float freq) {
     pio_sm_set_enabled(pio, sm_gen, true);
 }
 
+#define BER_REPORT_MS 10000
+
+void ber_report() {
+    ber_stats_t stats;
+    float       ber, low, high;
+    char        msg[160];
+
+    ber_get_stats(stats);
+    ber_confidence(stats, ber, low, high);
+
+    snprintf(msg, sizeof(msg), "BER PRBS-%u %s: %llu bits, %llu bit errors, BER %.3e (95%% %.3e..%.3e)\r\n",
+             stats.order, stats.locked ? "locked" : "hunting", static_cast<unsigned long long>(stats.bits),
+             static_cast<unsigned long long>(stats.bit_errors), ber, low, high);
+    tud_cdc_write_str(msg);
+
+    snprintf(msg, sizeof(msg), "Symbols %llu, symbol errors %llu, out of range %lu, resyncs %lu\r\n",
+             static_cast<unsigned long long>(stats.symbols), static_cast<unsigned long long>(stats.symbol_errors),
+             stats.out_of_range, stats.resyncs);
+    tud_cdc_write_str(msg);
+
+    tud_cdc_write_str("Error magnitude:");
+    for (int b = 0; b < BER_MAG_BUCKETS; b++) {
+        snprintf(msg, sizeof(msg), " %u-%u:%lu", 1u << b, (2u << b) - 1, stats.magnitude[b]);
+        tud_cdc_write_str(msg);
+    }
+    tud_cdc_write_str("\r\n");
+    tud_cdc_write_flush();
+}
+
+// "ber 15" / "ber 23" starts, "ber off" stops, "ber" reports
+static void ber_command(const char *arg) {
+    while (*arg == ' ') {
+        arg++;
+    }
+    if (*arg == '\0') {
+        ber_report();
+    }
+    else if (!strcmp(arg, "off")) {
+        ber_report();
+        ber_stop();
+        tud_cdc_write_str("BER mode off\r\n");
+    }
+    else if (ber_start(static_cast<uint8_t>(atoi(arg)))) {
+        tud_cdc_write_str("BER mode on\r\n");
+    }
+    else {
+        tud_cdc_write_str("Usage: ber 15|23|off\r\n");
+    }
+    tud_cdc_write_flush();
+}
+
+// Offset range over the codes of a sweep, the spread is the nonlinearity
+static float sweep_det_min, sweep_det_max, sweep_smp_min, sweep_smp_max;
+static bool  sweep_fresh = false;    // Next point is the first one
+
+void sweep_report(const sweep_point_t &point, bool first) {
+    char msg[160];
+
+    if (first) {
+        sweep_det_min = sweep_det_max = point.det_offset;
+        sweep_smp_min = sweep_smp_max = point.smp_offset;
+    }
+    sweep_det_min = fminf(sweep_det_min, point.det_offset);
+    sweep_det_max = fmaxf(sweep_det_max, point.det_offset);
+    sweep_smp_min = fminf(sweep_smp_min, point.smp_offset);
+    sweep_smp_max = fmaxf(sweep_smp_max, point.smp_offset);
+
+    snprintf(msg, sizeof(msg), "%4lu  detector n=%3lu %+7.2f sd %5.2f  sampler n=%3lu %+7.2f sd %5.2f\r\n", point.code,
+             point.det_count, point.det_offset, point.det_sd, point.smp_count, point.smp_offset, point.smp_sd);
+    tud_cdc_write_str(msg);
+
+    if (!sweep_tx_active()) {
+        snprintf(msg, sizeof(msg), "Sweep done, offset range: detector %.2f..%.2f, sampler %.2f..%.2f cycles\r\n",
+                 sweep_det_min, sweep_det_max, sweep_smp_min, sweep_smp_max);
+        tud_cdc_write_str(msg);
+    }
+    tud_cdc_write_flush();
+}
+
+// "sweep" covers all codes in steps of 16, "sweep <first> <last> <step>",
+// "sweep off" stops
+static void sweep_command(const char *arg) {
+    unsigned long first = 0, last = MAX_CODE - 1, step = 16;
+
+    while (*arg == ' ') {
+        arg++;
+    }
+    if (!strcmp(arg, "off")) {
+        sweep_stop();
+        tud_cdc_write_str("Sweep stopped\r\n");
+    }
+    else if ((*arg == '\0' || sscanf(arg, "%lu %lu %lu", &first, &last, &step) == 3) &&
+             sweep_start(first, last, step)) {
+        sweep_fresh = true;
+        tud_cdc_write_str("Sweep: offset from the nominal pause and its sd, cycles. "
+                          "Detector 2 cycles/count, sampler 1 cycle/sample\r\n");
+    }
+    else {
+        tud_cdc_write_str("Usage: sweep [first last step]|off\r\n");
+    }
+    tud_cdc_write_flush();
+}
+
 // Function for processing user commands
 void process_command(const char *input) {
+    if (!strncmp(input, "ber", 3)) {
+        ber_command(input + 3);
+        return;
+    }
+    if (!strncmp(input, "sweep", 5)) {
+        sweep_command(input + 5);
+        return;
+    }
+
     char *endptr;
     int   value = strtol(input, &endptr, 10);
 
@@ -93,6 +225,30 @@ void process_received_measurements() {
     }
 }
 
+// Vendor interface <-> PPM data link
+void link_task() {
+    static uint8_t buf[LINK_MAX_PAYLOAD];
+
+    // Host -> laser, one frame per call while there is room for a full frame
+    if (tud_vendor_available() && link_tx_free() >= LINK_MAX_SYMBOLS) {
+        uint32_t count = tud_vendor_read(buf, sizeof(buf));
+        if (count > 0) {
+            link_tx_queue_frame(buf, static_cast<uint16_t>(count));
+        }
+    }
+
+    // Laser -> host
+    uint32_t room = tud_vendor_write_available();
+    if (room > sizeof(buf)) {
+        room = sizeof(buf);
+    }
+    if (room > 0 && link_rx_available()) {
+        size_t count = link_rx_read(buf, room);
+        tud_vendor_write(buf, static_cast<uint32_t>(count));
+        tud_vendor_write_flush();
+    }
+}
+
 uint32_t calculate_audio_frame_ticks() {
     // return (uint32_t)clock_get_hz(clk_sys) / current_sample_rate / 100;
     return 1000000 / current_sample_rate;
@@ -117,6 +273,7 @@ void second_core_main() {
     size_t          input_pos            = 0;
     static uint8_t  led_state            = 0;
     absolute_time_t next_led_toggle_time = make_timeout_time_ms(LED_TIME * 2);
+    absolute_time_t next_ber_report      = make_timeout_time_ms(BER_REPORT_MS);
 
     audio_frame_ticks = calculate_audio_frame_ticks();
 
@@ -130,6 +287,7 @@ void second_core_main() {
         tud_task();
 
         process_received_measurements();
+        link_task();
 
         if (tud_cdc_connected()) {
             if (!was_connected) {
@@ -148,6 +306,8 @@ void second_core_main() {
                 tud_cdc_write_str(std::to_string(current_sample_rate).c_str());
                 tud_cdc_write_str(" Hz\r\n");
                 tud_cdc_write_str("Enter a value from 0 to 1024 to send via PPM.\r\n");
+                tud_cdc_write_str("ber 15|23 runs a PRBS bit error test, ber reports, ber off stops.\r\n");
+                tud_cdc_write_str("sweep [first last step] compares the detector with the sampler, sweep off stops.\r\n");
                 tud_cdc_write_flush();
                 was_connected = true;
             }
@@ -178,6 +338,23 @@ void second_core_main() {
         else {
             was_connected = false;
         }
-        sleep_ms(1);
+
+        sweep_point_t point;
+        if (sweep_poll(point) && tud_cdc_connected()) {
+            sweep_report(point, sweep_fresh);
+            sweep_fresh = false;
+        }
+
+        if (absolute_time_diff_us(get_absolute_time(), next_ber_report) <= 0) {
+            if (ber_tx_active() && tud_cdc_connected()) {
+                ber_report();
+            }
+            next_ber_report = make_timeout_time_ms(BER_REPORT_MS);
+        }
+        // Keep polling while the data link has work, a 1 ms nap would
+        // cap it at one USB packet per frame
+        if (!tud_vendor_available() && !link_rx_available()) {
+            sleep_ms(1);
+        }
     }
 }
\ No newline at end of file
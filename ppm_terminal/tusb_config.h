@@ -31,6 +31,12 @@
 #define CFG_TUD_CDC_TX_BUFSIZE  (64)
 #define CFG_TUD_CDC_EP_BUFSIZE  (64)
 
+// Vendor bulk interface for the raw PPM data link
+#define CFG_TUD_VENDOR             (1)
+#define CFG_TUD_VENDOR_RX_BUFSIZE  (512)
+#define CFG_TUD_VENDOR_TX_BUFSIZE  (512)
+#define CFG_TUD_VENDOR_EPSIZE      (64)
+
 #ifndef CFG_TUD_ENDPOINT0_SIZE
 #define CFG_TUD_ENDPOINT0_SIZE  (64)
 #endif
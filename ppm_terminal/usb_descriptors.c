@@ -12,7 +12,7 @@
 #define _PID_MAP(itf, n)  ( (CFG_TUD_##itf) << (n) )
 #define CDC_EXAMPLE_VID     0xCafe
 // use _PID_MAP to generate unique PID for each interface
-#define CDC_EXAMPLE_PID     (0x4000 | _PID_MAP(CDC, 0))
+#define CDC_EXAMPLE_PID     (0x4000 | _PID_MAP(CDC, 0) | _PID_MAP(VENDOR, 4))
 // set USB 2.0
 #define CDC_EXAMPLE_BCD     0x0200
 
@@ -45,16 +45,19 @@ uint8_t const *tud_descriptor_device_cb(void);
 enum {
     ITF_NUM_CDC = 0,
     ITF_NUM_CDC_DATA,
+    ITF_NUM_VENDOR,
     ITF_NUM_TOTAL
 };
 
 // total length of configuration descriptor
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN)
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN)
 
 // define endpoint numbers
 #define EPNUM_CDC_NOTIF   0x81 // notification endpoint for CDC
 #define EPNUM_CDC_OUT     0x02 // out endpoint for CDC
 #define EPNUM_CDC_IN      0x82 // in endpoint for CDC
+#define EPNUM_VENDOR_OUT  0x03 // out endpoint for the PPM data link
+#define EPNUM_VENDOR_IN   0x83 // in endpoint for the PPM data link
 
 // configure descriptor (for 1 CDC interface)
 uint8_t const desc_configuration[] = {
@@ -63,6 +66,9 @@ uint8_t const desc_configuration[] = {
 
     // CDC: Communication Interface - TODO: get 64 from tusb_config.h
     TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 4, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+
+    // Vendor: raw PPM data link
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 6, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, CFG_TUD_VENDOR_EPSIZE),
 };
 
 // called when host requests to get configuration descriptor
@@ -94,6 +100,8 @@ enum {
     STRID_PRODUCT,      // 2: Product
     STRID_SERIAL,       // 3: Serials
     STRID_CDC,          // 4: CDC Interface
+    STRID_RESET,        // 5: Reset Interface
+    STRID_VENDOR,       // 6: Data link Interface
 };
 
 // array of pointer to string descriptors
@@ -104,7 +112,8 @@ char const *string_desc_arr[] = {
     "ppm2c",                    // 2: Product
     NULL,                           // 3: Serials (null so it uses unique ID if available)
     "ppm2c",           // 4: CDC Interface
-    "PPMReset"                      // 5: Reset Interface
+    "PPMReset",                     // 5: Reset Interface
+    "ppm2c data"                    // 6: Data link Interface
 };
 
 // buffer to hold the string descriptor during the request | plus 1 for the null terminator